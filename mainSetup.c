@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,590 +12,9620 @@
 #include <fcntl.h>
 #include <stdbool.h>
 #include <sys/stat.h>
+#include <spawn.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <time.h>
+#include <termios.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
-#define MAX_INPUT_SIZE 1024
-#define MAX_ARG_SIZE 64
+#define INPUT_CHUNK_SIZE 4096
+#define BATCH_CHUNK_SIZE (64 * 1024)
+#define JOB_PID_BUCKETS 64
+#define LEX_ERROR -1
+#define LEX_INCOMPLETE -2
 #define MAX_FILE_NAME_SIZE 1024
-#define MAX_LINE_SIZE 512
-#define MAX_BOOKMARKS 10
+#define HISTORY_SIZE 100000 // entries kept in memory, MYSHELL_HISTSIZE overrides
+#define HISTORY_BATCH 4096  // bytes of new lines collected per log append
+#define BOOKMARK_MAGIC "MYSHBM02"
+#define BOOKMARK_MAGIC_V1 "MYSHBM01" // words without operator flags, lexed again on load
+#define BOOKMARK_DEPTH 16 // bookmarks running bookmarks
+#define MAX_PATH_SIZE 256
+#define EXEC_CACHE_BUCKETS 256
+#define LAUNCH_FORK 0
+#define LAUNCH_SPAWN 1
+#define SCAN_MMAP_THRESHOLD (256 * 1024)
+#define DIRENT_BUFFER_SIZE (128 * 1024)
+#define SINK_FLUSH_SIZE (64 * 1024)
+#define ORDER_WINDOW 256 // --sorted: files scanned ahead of the one being written
+#define REGEX_MAX_REPEAT 1000
+#define REGEX_MAX_STATES 100000 // NFA size, however the repeats nest
+#define REGEX_MAX_LITERAL 64
+#define DFA_MAX_STATES 4096
+#define DFA_HASH_SIZE 8192
+#define BINARY_CHECK_SIZE 8192
+#define URING_ENTRIES 64
+#define URING_FILES 32
+#define URING_IDLE 0
+#define URING_OPEN 1
+#define URING_READ 2
+#define URING_CLOSE 3
+#define OUTPUT_LINES 0
+#define OUTPUT_FILES 1
+#define OUTPUT_COUNT 2
+#define OUTPUT_QUIET 3
+#define SEARCH_CACHE_MAGIC "MYSHRC01"
+#define SEARCH_CACHE_DEFAULT_SIZE (64 * 1024 * 1024)
+#define IGNORE_EXACT 0
+#define IGNORE_SUFFIX 1
+#define IGNORE_GLOB 2
+
+// regex syntax tree nodes
+#define REGEX_EMPTY 0
+#define REGEX_CHARSET 1
+#define REGEX_BOL 2
+#define REGEX_EOL 3
+#define REGEX_CONCAT 4
+#define REGEX_ALTERNATE 5
+#define REGEX_REPEAT 6
+
+// NFA states
+#define NFA_CHARSET 0
+#define NFA_SPLIT 1
+#define NFA_BOL 2
+#define NFA_EOL 3
+#define NFA_MATCH 4
+#define INDEX_FILE_NAME ".myshell_trigram.idx"
+#define INDEX_MAGIC "MYSHTRI1"
 #define CREATE_MODE (S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH)
 
-void setup(char inputBuffer[], char *args[], int *background);
+// command -> absolute path cache entry (bash'teki hash tablosu gibi)
+struct execCacheEntry
+{
+    char *command;
+    char *fullPath;
+    int hits;
+    struct execCacheEntry *next;
+};
+
+struct job;
+
+struct jobProcess
+{
+    pid_t pid;
+    int status;
+    int done;
+    int stopped;
+    struct job *job;
+    struct jobProcess *next; // pid hash chain
+};
+
+struct job
+{
+    int id;
+    struct jobProcess *processes;
+    int processCount;
+    int running; // processes not yet reaped
+    int stopped; // of those, the ones stopped by a signal
+    int status;  // of the last process
+    int background;
+    int notified; // its stop has been reported
+    pid_t pgid;
+    char *command;
+    struct timespec started;
+    struct timespec finished;
+    struct termios modes; // terminal settings when it stopped
+    int hasModes;
+};
+
+struct bookmarkFileHeader
+{
+    char magic[8];
+};
+
+// One bookmark as stored on disk, followed by the name, the command line,
+// the resolved path and the words, each NUL-terminated; padded to 8 bytes.
+// Every word starts with a byte that is 1 for an operator, 0 otherwise.
+struct bookmarkRecord
+{
+    uint32_t size;
+    uint32_t argCount;
+    uint32_t nameLength; // 0 when unnamed
+    uint32_t commandLength;
+    uint32_t pathLength; // 0 for builtins, pipelines and unresolved commands
+    uint32_t background;
+};
+
+struct bookmark
+{
+    const struct bookmarkRecord *record;
+    const char *name; // NULL when unnamed
+    const char *command;
+    const char *path;
+    const char *words;
+    size_t wordsLength; // up to the last word's NUL
+    char **args;        // into the record, set up on first run
+    int owned;          // record was allocated, not mapped from the file
+};
+
+// Numbers of the history entries containing one trigram, ascending; the
+// live ones start at start
+struct historyPostings
+{
+    uint32_t trigram;
+    size_t start;
+    size_t count;
+    size_t capacity;
+    long *numbers; // NULL for an empty slot
+};
+
+struct history
+{
+    char **lines; // ring, entry n at n % capacity
+    size_t capacity;
+    long first; // oldest entry kept
+    long next;  // number of the next entry
+    struct historyPostings *postings;
+    size_t postingMask;
+    size_t postingCount;
+    char *pending; // lines not yet in the log
+    size_t pendingLength;
+    size_t pendingCapacity;
+    char path[MAX_PATH_SIZE];
+    int enabled;
+};
+
+struct builtin
+{
+    const char *name;
+    int (*run)(char **args);
+};
+
+struct inputReader
+{
+    int fd;
+    char *data;
+    size_t length;
+    size_t capacity;
+    size_t chunkSize; // first allocation, larger when nobody is typing
+    size_t lineStart;
+    size_t lineEnd;
+    int eof; // also set up front for -c strings and mapped scripts
+    int lineReads; // stdin is a pipe the commands share: read byte by byte, never past a newline
+    int seekable; // stdin is a file the commands share, see lendInputOffset()
+    off_t lentOffset; // where the offset was left for the running command, -1 if not lent
+};
+
+// Words of the current command; data and args are reused between commands
+struct commandArena
+{
+    char *data;
+    size_t capacity;
+    char **args;
+    size_t argCount;
+    size_t argCapacity;
+};
+
+struct redirectSpec
+{
+    char *inFile;
+    char *outFile;
+    int outFlags;
+    char *errFile;
+};
+
+// Record layout returned by getdents64()
+struct linuxDirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+struct dirIterator
+{
+    int fd; // not owned
+    char *buffer;
+    size_t size;
+    long used;
+    long offset;
+};
+
+struct regexNode
+{
+    int type;
+    unsigned char set[32]; // REGEX_CHARSET: one bit per byte value
+    int min;               // REGEX_REPEAT bounds, max -1 for unbounded
+    int max;
+    struct regexNode *left;
+    struct regexNode *right;
+};
+
+struct regexParser
+{
+    const char *pos;
+    const char *error;
+};
+
+struct nfaState
+{
+    int type;
+    int out;
+    int out1; // second branch of NFA_SPLIT
+    unsigned char set[32];
+};
+
+struct regexProgram
+{
+    struct nfaState *states;
+    int stateCount;
+    int stateCapacity;
+    int start;
+    int tooLarge; // compilation stopped at REGEX_MAX_STATES or out of memory
+    char literal[REGEX_MAX_LITERAL + 1]; // substring every match contains, for the prefilter
+    size_t literalLength;
+};
+
+struct dfaState
+{
+    int *nfaStates; // sorted NFA state set
+    int count;
+    int isMatch;
+    int eolMatch; // -1 until computed
+    int chain;    // next state in the same hash bucket
+    int next[256];
+};
+
+// Per-worker DFA cache built on demand from a shared regexProgram
+struct lazyDfa
+{
+    const struct regexProgram *prog;
+    struct dfaState *states;
+    int stateCount;
+    int *buckets;
+    int startBol;
+    int startMid;
+    int *stack;
+    int *set;
+    int setCount;
+    unsigned int *marks;
+    unsigned int generation;
+};
+
+struct searchOptions
+{
+    char *searchString; // patterns[0]
+    char **patterns;
+    unsigned char *ownedPatterns;
+    int patternCount;
+    int patternCapacity;
+    int recursive;
+    int jobs;
+    int sorted; // --sorted: emit results in path order
+    int useRegex; // -E: searchString is a regular expression
+    int noIgnore; // --no-ignore: do not read .gitignore/.ignore
+    const struct suffixTable *fileFilter; // -t types, the c type by default
+    off_t maxFileSize; // --max-filesize, 0 for no limit
+    int noCache; // --no-cache: do not consult or update the result cache
+    int outputMode; // OUTPUT_LINES, or -l, -c, -q
+    size_t maxCount; // -m: matches reported per file, 0 for no limit
+    int ioUring; // --io-uring: batch opens and reads through io_uring
+};
+
+struct resultSink
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed; // an append did not fit: bytes were dropped since the last flush
+};
+
+// --sorted: a file between the walk, which queues files in path order, and
+// the output, which takes them from the head of the window once scanned
+struct orderedFile
+{
+    int fd; // -1 when the matches are replayed from the cache
+    const char *cached;
+    int cacheable; // st identifies what fd has open, for a cache entry
+    struct stat st;
+    char *path;
+    struct resultSink sink; // the file's whole output
+    int done;
+};
+
+struct fileType
+{
+    char *name;
+    char **extensions;
+    int extensionCount;
+    int extensionCapacity;
+};
+
+// Extensions of the enabled file types, NULL-terminated probe chains
+struct suffixTable
+{
+    const char **slots;
+    size_t mask;
+};
+
+struct ignoreRule
+{
+    char *pattern; // the suffix for IGNORE_SUFFIX
+    size_t length;
+    int kind;
+    int negate;
+    int dirOnly;
+    int anchored; // matched against the path relative to the scope, not the name
+};
+
+// Rules of one directory's ignore files, chained to the enclosing scope
+struct ignoreScope
+{
+    struct ignoreScope *parent;
+    char *path;
+    size_t pathLength;
+    struct ignoreRule *rules;
+    int ruleCount;
+    int ruleCapacity;
+    atomic_int refs;
+};
+
+// On-disk result cache: header, key, then entries each followed by their
+// matches (cacheMatchHeader plus the line's bytes)
+struct cacheFileHeader
+{
+    char magic[8];
+    uint32_t keyLength;
+    uint32_t reserved;
+    uint64_t entryCount;
+};
+
+struct cacheEntryHeader
+{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint32_t matchCount;
+    uint32_t dataLength;
+};
+
+struct cacheMatchHeader
+{
+    uint32_t lineNumber;
+    int32_t pattern; // -1 for a single pattern
+    uint32_t length;
+};
+
+struct searchCache
+{
+    char dir[MAX_FILE_NAME_SIZE];
+    char path[MAX_FILE_NAME_SIZE + 32];
+    char *key;
+    size_t keyLength;
+    char *map;
+    size_t mapLength;
+    const char **slots; // entries by (dev, inode)
+    size_t mask;
+    uint64_t entryCount;
+    atomic_int misses;
+};
+
+struct searchDir
+{
+    int fd;
+    char *path;
+    struct ignoreScope *scope;
+    atomic_int refs;
+};
+
+// A directory waiting to be scanned, opened relative to its parent's descriptor
+struct searchTask
+{
+    struct searchDir *parent;
+    char *name;
+    char *path;
+};
+
+struct sortedEntry
+{
+    char *name;
+    unsigned char type;
+};
+
+// A file moving through a worker's ring: openat, read, scan, close
+struct uringFile
+{
+    int state;
+    int fd;
+    struct searchDir *dir; // held until the open completes
+    struct stat st;
+    char *data;
+    size_t capacity;
+    size_t done;
+    char name[NAME_MAX + 1];
+    char path[MAX_FILE_NAME_SIZE];
+};
+
+struct uringQueue
+{
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    size_t sqesSize;
+    unsigned unsubmitted;
+    int active; // slots not idle
+    int failed; // io_uring_enter failed, the ring is given up
+    struct uringFile files[URING_FILES];
+    int freeFiles[URING_FILES];
+    int freeCount;
+};
+
+struct taskDeque
+{
+    pthread_mutex_t lock;
+    struct searchTask **items;
+    int head;
+    int tail;
+    int capacity;
+};
+
+struct searchWorker
+{
+    int id;
+    pthread_t thread;
+    struct taskDeque deque;
+    struct searchContext *ctx;
+    char *buffer; // holds small files read in one go
+    size_t bufferSize;
+    char *direntBuffer;
+    struct resultSink sink;
+    struct lazyDfa dfa;
+    struct resultSink cacheOut; // cache entries of the files this worker visited
+    size_t cacheEntry; // offset of the entry being filled, SIZE_MAX if none
+    uint64_t cacheEntries;
+    struct uringQueue *uring; // NULL for blocking reads
+};
+
+struct ahoCorasick
+{
+    int32_t *delta; // stateCount x classCount transitions
+    unsigned char byteClass[256]; // column of each byte; bytes in no pattern share column 0
+    int classCount;
+    int32_t *output; // pattern ending at a state (shortest), -1 if none
+    int32_t *fail;
+    int stateCount;
+    int stateCapacity;
+    char **patterns;
+    size_t *patternLengths;
+    int emptyPattern; // an empty pattern in the set, -1 if none; kept off the root's output
+};
+
+struct searchContext
+{
+    struct searchOptions *options;
+    size_t searchLength;
+    struct ahoCorasick *automaton; // only with more than one pattern
+    struct regexProgram *regex;     // only with -E
+    struct searchCache *cache;      // NULL with --no-cache
+    int workerCount;
+    struct searchWorker *workers;
+    atomic_int pending; // tasks queued or running
+    atomic_int queued;  // tasks sitting in some deque
+    pthread_mutex_t idleLock;
+    pthread_cond_t idleCond;
+    pthread_mutex_t outputLock;
+    atomic_int matched; // some file matched
+    atomic_int stopped; // -q found its match, the walk is abandoned
+    atomic_int dropped; // matches or files were lost to a failure, reported when it happened
+    // --sorted: files [orderHead, orderTail) of the window, those from
+    // orderNext on not claimed by a worker yet; all under outputLock
+    struct orderedFile *ordered;
+    size_t orderHead;
+    size_t orderNext;
+    size_t orderTail;
+    int walkDone;
+    pthread_cond_t orderCond;
+};
+
+// On-disk trigram index layout: header, file records, NUL-terminated paths,
+// trigram records sorted by trigram, then the posting lists they point into
+struct indexHeader
+{
+    char magic[8];
+    uint32_t fileCount;
+    uint32_t trigramCount;
+    uint64_t filesOffset;
+    uint64_t pathsOffset;
+    uint64_t trigramsOffset;
+    uint64_t postingsOffset;
+};
+
+struct indexFileRecord
+{
+    uint64_t ino;
+    uint64_t size;
+    int64_t mtimeSec;
+    int64_t mtimeNsec;
+    uint32_t pathOffset;
+    uint32_t reserved;
+};
+
+struct indexTrigramRecord
+{
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t first; // index into the postings array
+};
+
+// A memory-mapped index
+struct trigramIndex
+{
+    void *map;
+    size_t size;
+    const struct indexHeader *header;
+    const struct indexFileRecord *files;
+    const char *paths;
+    const struct indexTrigramRecord *trigrams;
+    const uint32_t *postings;
+    uint32_t *slots; // path hash -> file id, see hashIndexPaths()
+    size_t slotCount;
+};
+
+// What an indexed search walks the tree with
+struct indexQuery
+{
+    const struct trigramIndex *index;
+    const unsigned char *isCandidate;
+    struct searchWorker *worker;
+    const char *root;
+};
+
+struct postingList
+{
+    uint32_t trigram;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *ids;
+};
+
+// trigram -> posting list, open addressing
+struct trigramTable
+{
+    struct postingList *slots;
+    size_t capacity;
+    size_t count;
+};
+
+struct indexBuild
+{
+    struct trigramTable table;
+    struct suffixTable filter; // every registered type
+    struct indexFileRecord *files;
+    uint32_t *reuse; // old id of an unchanged file, UINT32_MAX if rescanned
+    size_t fileCount;
+    size_t fileCapacity;
+    char *paths;
+    size_t pathsLength;
+    size_t pathsCapacity;
+    size_t rescanned;
+    struct trigramIndex old;
+    struct searchWorker loader;
+};
+
+extern char **environ;
+
+int readCommand(struct inputReader *reader, struct commandArena *arena, int *background);
+int openScriptInput(struct inputReader *reader, const char *path);
+void lendInputOffset(struct inputReader *reader);
+void reclaimInputOffset(struct inputReader *reader);
+int lexCommand(struct commandArena *arena, const char *line, size_t length, int *background);
 void executeCommand(char **args, int background);
 int findExecutable(const char *command, char *fullPath);
 void searchFiles(const char *searchString, int recursive);
-void searchFilesKaragul(char *searchString, int recursive);
-void searchFilesKaragulHelper(const char *filePath, const char *searchString);
-void redirection(char **args);
+int searchFilesKaragul(struct searchOptions *options);
+void searchFilesKaragulHelper(struct searchWorker *worker, int fd, const char *filePath);
+void searchFileText(struct searchWorker *worker, const char *text, size_t len, const char *filePath);
+void searchDirectory(struct searchWorker *worker, struct searchTask *task);
+void searchOpenedFile(struct searchWorker *worker, int fd, const char *path);
+void abandonUring(struct searchWorker *worker);
+void selectScanEngine();
+void initFileTypes();
+int searchCommand(char **args);
+void buildTrigramIndex(const char *dir);
+int indexedSearch(struct searchOptions *options);
+void addSearchPattern(struct searchOptions *options, char *pattern, int owned);
+struct ignoreScope *retainIgnoreScope(struct ignoreScope *scope);
+off_t parseSize(const char *text);
+void closeSearchCache(struct searchCache *cache);
+int compareInts(const void *a, const void *b);
+const char *scanRegex(struct searchWorker *worker, const char *pos, const char *end);
+void freeRegexProgram(struct regexProgram *prog);
+void freeAhoCorasick(struct ahoCorasick *ac);
+int comparePostingLists(const void *a, const void *b);
+int checkTrigramIndex(struct trigramIndex *index);
+int redirection(char **args);
+int parseRedirections(char **args, struct redirectSpec *spec);
 
 void unredirection();
-void addBookmark(const char *command);
+int addBookmark(const char *name, const char *command);
 void listBookmarks();
-void executeBookmark(int index);
-void deleteBookmark(int index);
-void exitShell();
+int executeBookmark(int index);
+int deleteBookmark(int index);
+void loadBookmarks();
+int findBookmark(const char *spec);
+int runBookmarks(char **specs);
+struct bookmarkRecord *buildBookmarkRecord(const char *name, const char *command);
+void saveBookmarks();
+int isOperator(const char *word);
+char *operatorFor(const char *word);
+void initHistory();
+void addHistory(const char *text, size_t length);
+void flushHistory();
+void hangUpShell(int signo);
+int writeAll(int fd, struct iovec *iov, int count);
+int expandHistory();
+int historyCommand(char **args);
+int exitShell(char **args);
+int hashCommand(char **args);
+void flushExecCache();
+void spawnCommand(char **args, int background);
+void waitForChild(pid_t pid, int background);
+void waitForJob(pid_t *pids, int count, int background);
+void runPipeline(char **args, int background);
+int startStage(char **stageArgs, int inFd, int outFd, pid_t pgid, int foreground, pid_t *pid);
+int launchStage(char **stageArgs, const struct redirectSpec *spec, const char *fullPath, int inFd, int outFd, pid_t pgid,
+                int foreground, pid_t *pid);
+int launchBuiltinStage(const struct builtin *builtin, char **stageArgs, const struct redirectSpec *spec, int inFd,
+                       int outFd, pid_t pgid, int foreground, pid_t *pid);
+int isPipeline(char **args);
+int applyRedirections(const struct redirectSpec *spec);
+int openRedirections(const struct redirectSpec *spec, int fds[3]);
+void closeRedirections(int fds[3]);
+int launchCommand(char **args);
+int bookmarkCommand(char **args);
+int cdCommand(char **args);
+int pwdCommand(char **args);
+int echoCommand(char **args);
+int trueCommand(char **args);
+int falseCommand(char **args);
+int exportCommand(char **args);
+int unsetCommand(char **args);
+int typeCommand(char **args);
+const struct builtin *findBuiltin(const char *name);
+int runBuiltin(const struct builtin *builtin, char **args);
+void initJobTable();
+void resetChildSignals();
+struct job *addJob(pid_t *pids, int count, int background);
+void removeJob(struct job *job);
+void updateJobProcess(struct jobProcess *process, int status);
+void reapChildren();
+void notifyJobs();
+void initJobControl();
+void setSpawnGroup(posix_spawn_file_actions_t *actions, pid_t pgid, int foreground);
+void enterJobGroup(pid_t pgid, int foreground);
+void waitForegroundJob(struct job *job);
+int jobIsStopped(const struct job *job);
+void signalJob(struct job *job, int signo);
+int jobsCommand(char **args);
+int fgCommand(char **args);
+int bgCommand(char **args);
+int waitCommand(char **args);
+int parallelCommand(char **args);
+int batchrunCommand(char **args);
 
-volatile sig_atomic_t isRunningInBackground = 0;
-char *bookmarks[MAX_BOOKMARKS];
+struct history history;
+struct bookmark *bookmarks;
 int bookmarkCount = 0;
-int redirection_fd = -1; // Dosya tanımlayıcısını global olarak
+int bookmarkCapacity = 0;
+int *bookmarkNames; // index + 1 by name hash, 0 for an empty slot
+size_t bookmarkNameMask;
+int bookmarksLoaded = 0;
+void *bookmarkMap;
+size_t bookmarkMapSize;
 int unRedirection = 0;
 int original_stdin;
 int original_stdout;
 int original_stderr;
 int background = 0;
-char inputBuffer[MAX_INPUT_SIZE];
-char *args[MAX_ARG_SIZE];
+struct inputReader input = {.fd = STDIN_FILENO, .chunkSize = INPUT_CHUNK_SIZE, .lentOffset = -1};
+int interactive = 1; // reading a terminal: prompts and the exit message
+struct commandArena commandArena;
+struct commandArena bookmarkArena;
+char **args;
+// The lexer makes unquoted operators point at these, so comparing pointers
+// tells them from quoted words that merely spell "|" or ">"
+char pipeOperator[] = "|";
+char inputOperator[] = "<";
+char outputOperator[] = ">";
+char appendOperator[] = ">>";
+char errorOperator[] = "2>";
+struct execCacheEntry *execCache[EXEC_CACHE_BUCKETS];
+char *execCachePath = NULL; // PATH value the cache was filled with
+int launchMode = LAUNCH_SPAWN;
+int lastStatus = 0; // status of the last command
+const char *commandText; // line being run, inside the input buffer
+size_t commandLength;
+struct job **jobTable; // by id - 1
+int jobCapacity = 0;
+int jobHighest = 0;
+int jobCount = 0;
+struct jobProcess *jobPids[JOB_PID_BUCKETS];
+int childSignalFd = -1;
+posix_spawnattr_t spawnAttr;
+int jobControl = 0; // interactive on a terminal: jobs get their own groups
+int shellTerminal = -1;
+pid_t shellPgid;
+struct termios shellModes;
+const char *(*scanLiteral)(const char *text, size_t len, const char *needle, size_t needleLen);
+struct fileType *fileTypes;
+int fileTypeCount = 0;
+int fileTypeCapacity = 0;
+struct suffixTable defaultFilter;
 
-// Signal handler function
-void handleCtrlZ(int signo)
+int main(int argc, char *argv[])
 {
-    if (signo == SIGTSTP)
+
+    original_stdin = dup(STDIN_FILENO);
+    original_stdout = dup(STDOUT_FILENO);
+    original_stderr = dup(STDERR_FILENO);
+
+    selectScanEngine();
+    initFileTypes();
+
+    char *launchEnv = getenv("MYSHELL_LAUNCH");
+    if (launchEnv != NULL && strcmp(launchEnv, "fork") == 0)
     {
+        launchMode = LAUNCH_FORK;
+    }
 
-        printf("\nCtrl+Z received. Stopping the current process.\n");
+    // myshell -c 'commands' | myshell script | ... | myshell
+    if (argc > 1 && strcmp(argv[1], "-c") == 0)
+    {
+        if (argc < 3)
+        {
+            fprintf(stderr, "myshell: -c: option requires an argument\n");
+            return 2;
+        }
+        input.data = argv[2];
+        input.length = input.capacity = strlen(argv[2]);
+        input.eof = 1;
+        interactive = 0;
     }
-    else
+    else if (argc > 1)
     {
-        printf("No foreground process to stop.\n");
+        if (openScriptInput(&input, argv[1]) == -1)
+        {
+            fprintf(stderr, "myshell: %s: %s\n", argv[1], strerror(errno));
+            return 127;
+        }
+        interactive = 0;
+    }
+    else if (!isatty(STDIN_FILENO))
+    {
+        // The commands read the same stdin, so none of its lines may be
+        // buffered away from them: a file is read ahead and then seeked
+        // back, a pipe cannot be and is read up to the newline only
+        if (lseek(STDIN_FILENO, 0, SEEK_CUR) != -1)
+        {
+            input.seekable = 1;
+            input.chunkSize = BATCH_CHUNK_SIZE;
+        }
+        else
+        {
+            input.lineReads = 1;
+        }
+        interactive = 0;
     }
-}
-
-int main()
-{
 
-    original_stdin = dup(STDIN_FILENO);
-    original_stdout = dup(STDOUT_FILENO);
-    original_stderr = dup(STDERR_FILENO);
+    initJobTable();
+    initJobControl();
+    initHistory();
 
     while (1)
     {
         background = 0;
-        char *searchString;
-        int recursive;
-        printf("myshell: ");
+        if (jobCount > 0)
+        {
+            reapChildren();
+            notifyJobs();
+        }
+        if (interactive)
+        {
+            printf("myshell: ");
+        }
+        // Keeps builtin output ahead of whatever the next child writes
         fflush(stdout);
         //printf("1 background: %d\n", background);
-        setup(inputBuffer, args, &background);
+        int wordCount = readCommand(&input, &commandArena, &background);
+        if (wordCount == LEX_ERROR)
+        {
+            lastStatus = 2;
+            if (!interactive)
+            {
+                exit(lastStatus);
+            }
+            continue;
+        }
+        if (wordCount == 0)
+        {
+            continue; // blank line or comment
+        }
+        args = commandArena.args;
+        commandText = input.data + input.lineStart;
+        commandLength = input.lineEnd - input.lineStart;
+        if (expandHistory() == -1)
+        {
+            lastStatus = 1;
+            continue;
+        }
+        addHistory(commandText, commandLength);
         //printf("2 background: %d\n", background);
-        isRunningInBackground = background; // isRunningInBackground'ı ayarladım
-
-        if (!isRunningInBackground)
+        const struct builtin *builtin;
+        if (isPipeline(args))
         {
-            signal(SIGTSTP, handleCtrlZ);
+            runPipeline(args, background);
         }
-        else if (isRunningInBackground)
+        else if ((builtin = findBuiltin(args[0])) != NULL)
         {
-            signal(SIGTSTP, SIG_IGN);
+            lastStatus = runBuiltin(builtin, args);
         }
-
-        if (strcmp(args[0], "exit") == 0)
+        else if (launchMode == LAUNCH_SPAWN) // part A
         {
-            exitShell();
+            spawnCommand(args, background);
         }
-        
-        //printf("3 background: %d\n", background);
-
-        // search
-        if (strcmp(args[0], "search") == 0)
+        else
         {
-
-            if (args[1] != NULL)
+            if (redirection(args) == 0) // Redirection işlemi
             {
-                if (strcmp(args[1], "-r") == 0)
-                {
-                    if (args[2] != NULL)
-                    {
-                        searchString = args[2];
-                        recursive = 1;
-                    }
-                    else
-                    {
-                        printf("Usage: search -r filename or search filename\n");
-                    }
-                }
-                else
-                {
-                    searchString = args[1];
-                    recursive = 0;
-                }
-                searchFilesKaragul(searchString, recursive);
+                executeCommand(args, background);
             }
             else
             {
-                printf("Usage: search [-r] <searchedString> \n");
+                lastStatus = 1;
             }
+            unredirection(); // Unredirection işlemi
+        }
+    }
+
+    return 0;
+}
+
+// Input: lines are taken from a growable buffer that read() refills, so a
+// command may be any length, may arrive over several reads and may share a
+// read with the lines after it. The current line is [lineStart, lineEnd).
+// Returns 0 when a complete line (or the unterminated tail at EOF) is ready
+int fillInputLine(struct inputReader *reader, size_t from)
+{
+    while (1)
+    {
+        char *newline = memchr(reader->data + from, '\n', reader->length - from);
+        if (newline != NULL)
+        {
+            reader->lineEnd = newline - reader->data + 1;
+            return 0;
+        }
+        if (reader->eof)
+        {
+            reader->lineEnd = reader->length;
+            return reader->lineEnd > from ? 0 : -1;
+        }
+
+        // Keep the current line at the front, then make room for more
+        if (reader->lineStart > 0)
+        {
+            memmove(reader->data, reader->data + reader->lineStart, reader->length - reader->lineStart);
+            reader->length -= reader->lineStart;
+            from -= reader->lineStart;
+            reader->lineStart = 0;
         }
-        else if (strcmp(args[0], "bookmark") == 0)
+        if (reader->length == reader->capacity)
         {
-            if (args[1] != NULL)
+            size_t capacity = reader->capacity ? reader->capacity * 2 : reader->chunkSize;
+            char *grown = realloc(reader->data, capacity);
+            if (grown == NULL)
             {
-                if (strcmp(args[1], "-l") == 0)
-                {
-                    // List bookmarks
-                    listBookmarks();
-                }
-                else if (strcmp(args[1], "-i") == 0)
-                {
-                    // Execute bookmark by index
-                    if (args[2] != NULL)
-                    {
-                        int index = atoi(args[2]);
-                        executeBookmark(index);
-                    }
-                    else
-                    {
-                        fprintf(stderr, "Usage: bookmark -i index\n");
-                    }
-                }
-                else if (strcmp(args[1], "-d") == 0)
-                {
-                    // Delete bookmark by index
-                    if (args[2] != NULL)
-                    {
-                        int index = atoi(args[2]);
-                        deleteBookmark(index);
-                    }
-                    else
-                    {
-                        fprintf(stderr, "Usage: bookmark -d index\n");
-                    }
-                }
-                else
-                {
-                    // Add new bookmark
-                    int bookmarkIndex = 1;
-                    char bookmarkCommand[MAX_INPUT_SIZE];
-                    strcpy(bookmarkCommand, args[bookmarkIndex]);
-                    for (int i = bookmarkIndex + 1; args[i] != NULL; i++)
-                    {
-                        strcat(bookmarkCommand, " ");
-                        strcat(bookmarkCommand, args[i]);
-                    }
-                    addBookmark(bookmarkCommand);
-                }
+                perror("realloc");
+                exit(-1);
             }
+            reader->data = grown;
+            reader->capacity = capacity;
         }
-        else // part A
+
+        from = reader->length;
+        if (childSignalFd != -1)
         {
-            redirection(args); // Redirection işlemi
-            executeCommand(args, background);
-            unredirection(); // Unredirection işlemi
+            // Reap children while waiting for input instead of leaving zombies
+            struct pollfd fds[2] = {{reader->fd, POLLIN, 0}, {childSignalFd, POLLIN, 0}};
+            if (poll(fds, 2, -1) == -1 && errno != EINTR)
+            {
+                perror("poll");
+                exit(-1);
+            }
+            if (fds[1].revents & POLLIN)
+            {
+                reapChildren();
+            }
+            if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+            {
+                continue;
+            }
+        }
+        ssize_t n = read(reader->fd, reader->data + reader->length, reader->lineReads ? 1 : reader->capacity - reader->length);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            perror("error reading the command");
+            flushHistory();
+            exit(-1);
         }
+        if (n == 0)
+        {
+            reader->eof = 1;
+        }
+        reader->length += n;
     }
+}
+
+// Maps a script so its lines are read in place; anything that cannot be
+// mapped (a pipe, /dev/stdin) is read in large blocks instead
+int openScriptInput(struct inputReader *reader, const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
 
+    if (fd == -1)
+    {
+        return -1;
+    }
+    reader->chunkSize = BATCH_CHUNK_SIZE;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        if (st.st_size > 0)
+        {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED)
+            {
+                close(fd);
+                return -1;
+            }
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            reader->data = map;
+            reader->length = reader->capacity = st.st_size;
+        }
+        reader->eof = 1;
+        close(fd);
+        return 0;
+    }
+    reader->fd = fd;
     return 0;
 }
 
-void setup(char inputBuffer[], char *args[], int *background)
+int nextInputLine(struct inputReader *reader)
+{
+    reader->lineStart = reader->lineEnd;
+    reclaimInputOffset(reader);
+    return fillInputLine(reader, reader->lineStart);
+}
+
+// While a command runs, a shared stdin file is left right after the command's
+// line, where a command reading its stdin expects to start
+void lendInputOffset(struct inputReader *reader)
+{
+    if (reader->seekable)
+    {
+        reader->lentOffset = lseek(reader->fd, -(off_t)(reader->length - reader->lineEnd), SEEK_CUR);
+    }
+}
+
+// Back at the prompt: the read-ahead is still good if the command did not
+// move the offset, otherwise it is dropped and reading goes on from there
+void reclaimInputOffset(struct inputReader *reader)
 {
-    int length, i, start, ct;
+    if (reader->lentOffset == -1)
+    {
+        return;
+    }
+    if (lseek(reader->fd, 0, SEEK_CUR) == reader->lentOffset)
+    {
+        lseek(reader->fd, reader->length - reader->lineEnd, SEEK_CUR);
+    }
+    else
+    {
+        reader->length = reader->lineEnd;
+        reader->eof = 0;
+    }
+    reader->lentOffset = -1;
+}
 
-    ct = 0;
-    start = -1;
+// Appends the following line to the current one, for quotes and \ spanning lines
+int extendInputLine(struct inputReader *reader)
+{
+    return fillInputLine(reader, reader->lineEnd);
+}
 
-    length = read(STDIN_FILENO, inputBuffer, MAX_INPUT_SIZE);
+void pushArenaArg(struct commandArena *arena, char *arg)
+{
+    if (arena->argCount + 1 >= arena->argCapacity)
+    {
+        arena->argCapacity = arena->argCapacity ? arena->argCapacity * 2 : 64;
+        arena->args = realloc(arena->args, arena->argCapacity * sizeof(char *));
+        if (arena->args == NULL)
+        {
+            perror("realloc");
+            exit(-1);
+        }
+    }
+    arena->args[arena->argCount++] = arg;
+}
 
-    if (length == 0)
-        exit(0);
+// Splits line into arena->args in one pass. Blanks separate words, '...'
+// is literal, "..." honours \ before $ ` " \ and newline, \ escapes any
+// character outside quotes, # starts a comment and a trailing & runs the
+// command in the background. Unquoted |, <, >, >> and 2> (at the start of a
+// word) are words of their own, whether or not blanks surround them. Words
+// never grow, so the arena is sized to the line up front and is reused, not
+// freed, from one command to the next.
+int lexCommand(struct commandArena *arena, const char *line, size_t length, int *background)
+{
+    static long argMax;
+    int inWord = 0;
 
-    if ((length < 0) && (errno != EINTR))
+    if (argMax == 0)
+    {
+        argMax = sysconf(_SC_ARG_MAX);
+    }
+    if (argMax > 0 && length > (size_t)argMax)
+    {
+        fprintf(stderr, "myshell: argument list too long\n");
+        return LEX_ERROR;
+    }
+    if (arena->capacity < length + 1)
+    {
+        free(arena->data);
+        arena->capacity = length + 1 > INPUT_CHUNK_SIZE ? length + 1 : INPUT_CHUNK_SIZE;
+        arena->data = malloc(arena->capacity);
+        if (arena->data == NULL)
+        {
+            perror("malloc");
+            exit(-1);
+        }
+    }
+    if (arena->args == NULL)
     {
-        perror("error reading the command");
-        exit(-1);
+        arena->argCapacity = 64;
+        arena->args = malloc(arena->argCapacity * sizeof(char *));
+        if (arena->args == NULL)
+        {
+            perror("malloc");
+            exit(-1);
+        }
     }
+    arena->argCount = 0;
+    *background = 0;
 
+    char *out = arena->data;
+    size_t i;
     for (i = 0; i < length; i++)
     {
-        switch (inputBuffer[i])
+        char c = line[i];
+
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
         {
-        case ' ':
-        case '\t':
-            if (start != -1)
+            if (inWord)
             {
-                args[ct] = &inputBuffer[start];
-                ct++;
+                *out++ = '\0';
+                inWord = 0;
             }
-            inputBuffer[i] = '\0';
-            start = -1;
+            continue;
+        }
+        if (c == '#' && !inWord)
+        {
             break;
-        case '\"':
-            if (start == -1)
+        }
+        if (c == '&')
+        {
+            size_t rest = i + 1;
+            while (rest < length && (line[rest] == ' ' || line[rest] == '\t' || line[rest] == '\n' || line[rest] == '\r'))
             {
-                start = i + 1;
+                rest++;
             }
-            else
+            if (rest < length && line[rest] != '#')
             {
-                inputBuffer[i] = '\0';
+                fprintf(stderr, "myshell: syntax error near unexpected token `&'\n");
+                return LEX_ERROR;
             }
+            *background = 1;
             break;
+        }
+
+        if (c == '\\' && (i + 1 == length || (line[i + 1] == '\n' && i + 2 == length)))
+        {
+            return LEX_INCOMPLETE;
+        }
+        if (c == '\\' && line[i + 1] == '\n')
+        {
+            // A line continuation joins the lines, inside a word or between words
+            i++;
+            continue;
+        }
 
-        case '\n':
-            if (start != -1)
+        if (c == '|' || c == '<' || c == '>' || (c == '2' && !inWord && i + 1 < length && line[i + 1] == '>'))
+        {
+            char *operator;
+            if (inWord)
             {
-                args[ct] = &inputBuffer[start];
-                ct++;
+                *out++ = '\0';
+                inWord = 0;
             }
-            inputBuffer[i] = '\0';
-            args[ct] = NULL;
-            break;
+            if (c == '2')
+            {
+                operator = errorOperator;
+                i++;
+            }
+            else if (c == '>' && i + 1 < length && line[i + 1] == '>')
+            {
+                operator = appendOperator;
+                i++;
+            }
+            else
+            {
+                operator = c == '|' ? pipeOperator : c == '<' ? inputOperator : outputOperator;
+            }
+            pushArenaArg(arena, operator);
+            continue;
+        }
 
-        default:
-            if (start == -1)
-                start = i;
-            if (inputBuffer[i] == '&')
+        if (!inWord)
+        {
+            pushArenaArg(arena, out);
+            inWord = 1;
+        }
+        if (c == '\'')
+        {
+            const char *close = memchr(line + i + 1, '\'', length - i - 1);
+            if (close == NULL)
+            {
+                return LEX_INCOMPLETE;
+            }
+            memcpy(out, line + i + 1, close - line - i - 1);
+            out += close - line - i - 1;
+            i = close - line;
+        }
+        else if (c == '"')
+        {
+            for (i++; i < length && line[i] != '"'; i++)
             {
+                if (line[i] == '\\' && i + 1 < length && strchr("$`\"\\\n", line[i + 1]) != NULL)
+                {
+                    if (line[++i] == '\n')
+                    {
+                        continue;
+                    }
+                }
+                *out++ = line[i];
+            }
+            if (i == length)
+            {
+                return LEX_INCOMPLETE;
+            }
+        }
+        else if (c == '\\')
+        {
+            *out++ = line[++i];
+        }
+        else
+        {
+            *out++ = c;
+        }
+    }
+    if (inWord)
+    {
+        *out = '\0';
+    }
+    arena->args[arena->argCount] = NULL;
+    return arena->argCount;
+}
+
+// Reads and splits the next command; returns its word count, 0 for a blank
+// line and LEX_ERROR after a syntax error. Exits at the end of input.
+int readCommand(struct inputReader *reader, struct commandArena *arena, int *background)
+{
+    if (nextInputLine(reader) == -1)
+    {
+        flushHistory();
+        exit(lastStatus);
+    }
+    while (1)
+    {
+        int count = lexCommand(arena, reader->data + reader->lineStart, reader->lineEnd - reader->lineStart, background);
+        if (count != LEX_INCOMPLETE)
+        {
+            lendInputOffset(reader);
+            return count;
+        }
+        if (interactive)
+        {
+            printf("> ");
+            fflush(stdout);
+        }
+        if (extendInputLine(reader) == -1)
+        {
+            fprintf(stderr, "myshell: unexpected end of input in an unfinished command\n");
+            return LEX_ERROR;
+        }
+    }
+}
 
-                *background = 1;
+// History: the last historySize commands live in a ring, numbered from the
+// first line of the log file. Every trigram of every entry maps to the
+// ascending numbers of the entries containing it, so a substring or prefix
+// search walks only the rarest trigram's list instead of the whole ring.
+// An evicted entry leaves the lists of its trigrams, and a list it empties
+// leaves the table, so both stay the size of what the ring holds. New
+// lines reach the log in batches through O_APPEND writes of whole lines,
+// which concurrent shells can share without tearing each other's lines.
+uint32_t historyTrigram(const char *text)
+{
+    return (uint32_t)(unsigned char)text[0] << 16 | (uint32_t)(unsigned char)text[1] << 8 | (unsigned char)text[2];
+}
 
-                if (i == length - 1 || inputBuffer[i + 1] == ' ' || inputBuffer[i + 1] == '\t' || inputBuffer[i + 1] == '\n')
-                {
+struct historyPostings *findHistoryPostings(uint32_t trigram, int create)
+{
+    size_t slot;
 
-                    inputBuffer[i] = '\0';
-                }
-                else
-                {
-                    printf("myshell: syntax error near unexpected token `&'\n");
-                    return;
-                }
+    if (create && (history.postingCount + 1) * 2 > history.postingMask + 1)
+    {
+        // Grow to keep the table at most half full
+        size_t slots = history.postingMask ? (history.postingMask + 1) * 2 : 1024;
+        struct historyPostings *grown = calloc(slots, sizeof(struct historyPostings));
+        if (grown == NULL)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; history.postingMask && i <= history.postingMask; i++)
+        {
+            if (history.postings[i].numbers == NULL)
+            {
+                continue;
+            }
+            slot = (history.postings[i].trigram * 2654435761u) & (slots - 1);
+            while (grown[slot].numbers != NULL)
+            {
+                slot = (slot + 1) & (slots - 1);
+            }
+            grown[slot] = history.postings[i];
+        }
+        free(history.postings);
+        history.postings = grown;
+        history.postingMask = slots - 1;
+    }
+    if (history.postings == NULL)
+    {
+        return NULL;
+    }
+
+    slot = (trigram * 2654435761u) & history.postingMask;
+    while (history.postings[slot].numbers != NULL)
+    {
+        if (history.postings[slot].trigram == trigram)
+        {
+            return &history.postings[slot];
+        }
+        slot = (slot + 1) & history.postingMask;
+    }
+    if (!create)
+    {
+        return NULL;
+    }
+    struct historyPostings *postings = &history.postings[slot];
+    postings->trigram = trigram;
+    postings->capacity = 4;
+    postings->numbers = malloc(postings->capacity * sizeof(long));
+    if (postings->numbers == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    history.postingCount++;
+    return postings;
+}
+
+// Deletes an emptied list. Linear probing has no tombstones: the entries
+// after it in its probe run move back so no lookup stops at the hole.
+void removeHistoryPostings(struct historyPostings *postings)
+{
+    size_t hole = postings - history.postings;
+    size_t slot = hole;
+
+    free(postings->numbers);
+    memset(postings, 0, sizeof(struct historyPostings));
+    history.postingCount--;
+    while (history.postings[slot = (slot + 1) & history.postingMask].numbers != NULL)
+    {
+        size_t home = (history.postings[slot].trigram * 2654435761u) & history.postingMask;
+        if (((slot - home) & history.postingMask) >= ((slot - hole) & history.postingMask))
+        {
+            history.postings[hole] = history.postings[slot];
+            memset(&history.postings[slot], 0, sizeof(struct historyPostings));
+            hole = slot;
+        }
+    }
+}
+
+// Takes an evicted entry out of its trigrams' lists, where it is the oldest
+void unindexHistoryLine(long number, const char *line, size_t length)
+{
+    for (size_t i = 0; i + 3 <= length; i++)
+    {
+        struct historyPostings *postings = findHistoryPostings(historyTrigram(line + i), 0);
+
+        if (postings == NULL || postings->start == postings->count || postings->numbers[postings->start] != number)
+        {
+            continue; // the trigram repeats within the line
+        }
+        if (++postings->start == postings->count)
+        {
+            removeHistoryPostings(postings);
+        }
+        else if (postings->start * 2 >= postings->count)
+        {
+            memmove(postings->numbers, postings->numbers + postings->start,
+                    (postings->count - postings->start) * sizeof(long));
+            postings->count -= postings->start;
+            postings->start = 0;
+        }
+    }
+}
+
+void indexHistoryLine(long number, const char *line, size_t length)
+{
+    for (size_t i = 0; i + 3 <= length; i++)
+    {
+        struct historyPostings *postings = findHistoryPostings(historyTrigram(line + i), 1);
+
+        if (postings->count > postings->start && postings->numbers[postings->count - 1] == number)
+        {
+            continue; // the trigram repeats within the line
+        }
+        if (postings->count == postings->capacity)
+        {
+            postings->capacity *= 2;
+            postings->numbers = realloc(postings->numbers, postings->capacity * sizeof(long));
+            if (postings->numbers == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        postings->numbers[postings->count++] = number;
+    }
+}
+
+const char *historyLine(long number)
+{
+    if (number < history.first || number >= history.next)
+    {
+        return NULL;
+    }
+    return history.lines[number % history.capacity];
+}
+
+// Puts a line in the ring as entry history.next, evicting the oldest
+void storeHistory(const char *line, size_t length)
+{
+    if (history.next - history.first == (long)history.capacity)
+    {
+        char *evicted = history.lines[history.first % history.capacity];
+        unindexHistoryLine(history.first, evicted, strlen(evicted));
+        free(evicted);
+        history.first++;
+    }
+    char *copy = strndup(line, length);
+    if (copy == NULL)
+    {
+        perror("strndup");
+        exit(EXIT_FAILURE);
+    }
+    history.lines[history.next % history.capacity] = copy;
+    indexHistoryLine(history.next, copy, length);
+    history.next++;
+}
+
+// Interactive shells only: loads the tail of the log, numbering entries by
+// their line in it
+void initHistory()
+{
+    const char *env = getenv("MYSHELL_HISTFILE");
+    struct stat st;
+
+    if (!interactive)
+    {
+        return;
+    }
+    if (env != NULL && env[0] != '\0')
+    {
+        snprintf(history.path, sizeof(history.path), "%s", env);
+    }
+    else if ((env = getenv("HOME")) != NULL && env[0] != '\0')
+    {
+        snprintf(history.path, sizeof(history.path), "%s/.myshell_history", env);
+    }
+    else
+    {
+        history.path[0] = '\0';
+    }
+    env = getenv("MYSHELL_HISTSIZE");
+    history.capacity = env != NULL && atol(env) > 0 ? (size_t)atol(env) : HISTORY_SIZE;
+    history.lines = calloc(history.capacity, sizeof(char *));
+    if (history.lines == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    history.first = history.next = 1;
+    history.enabled = 1;
+
+    // A hangup or a kill must not lose the lines still pending: both are
+    // read from the signalfd next to SIGCHLD, see hangUpShell()
+    if (childSignalFd != -1)
+    {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigaddset(&mask, SIGHUP);
+        sigaddset(&mask, SIGTERM);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+        signalfd(childSignalFd, &mask, 0);
+    }
+
+    int fd = history.path[0] != '\0' ? open(history.path, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd == -1)
+    {
+        return;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size == 0)
+    {
+        close(fd);
+        return;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        return;
+    }
+
+    // Walk back to the start of the last capacity lines, then count the
+    // lines before them so numbers match the file
+    const char *end = map + st.st_size;
+    const char *from = end;
+    const char *scan = end[-1] == '\n' ? end - 1 : end;
+    for (size_t kept = 0; kept < history.capacity && scan > map; kept++)
+    {
+        const char *newline = memrchr(map, '\n', scan - map);
+        if (newline == NULL)
+        {
+            from = map;
+            break;
+        }
+        from = newline + 1;
+        scan = newline;
+    }
+    for (const char *p = map; p < from && (p = memchr(p, '\n', from - p)) != NULL; p++)
+    {
+        history.next++;
+    }
+    history.first = history.next;
+
+    for (const char *line = from; line < end;)
+    {
+        const char *newline = memchr(line, '\n', end - line);
+        if (newline == NULL)
+        {
+            newline = end;
+        }
+        storeHistory(line, newline - line);
+        line = newline + 1;
+    }
+    munmap(map, st.st_size);
+}
+
+// Writes the batched lines with one append
+void flushHistory()
+{
+    if (history.pendingLength == 0 || history.path[0] == '\0')
+    {
+        return;
+    }
+    int fd = open(history.path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd != -1)
+    {
+        struct iovec iov = {history.pending, history.pendingLength};
+        if (writeAll(fd, &iov, 1) == -1)
+        {
+            perror("myshell: history");
+        }
+        close(fd);
+    }
+    history.pendingLength = 0;
+}
+
+// Records a command as typed, trailing blanks dropped and a multi-line
+// command joined into one line; repeats of the last entry are skipped
+void addHistory(const char *text, size_t length)
+{
+    if (!history.enabled)
+    {
+        return;
+    }
+    while (length > 0 && isspace((unsigned char)text[length - 1]))
+    {
+        length--;
+    }
+    const char *last = historyLine(history.next - 1);
+    if (length == 0 || (last != NULL && strlen(last) == length && memcmp(last, text, length) == 0))
+    {
+        return;
+    }
+
+    if (history.pendingLength + length + 1 > history.pendingCapacity)
+    {
+        history.pendingCapacity = history.pendingLength + length + 1 + HISTORY_BATCH;
+        history.pending = realloc(history.pending, history.pendingCapacity);
+        if (history.pending == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    char *line = history.pending + history.pendingLength;
+    memcpy(line, text, length);
+    for (size_t i = 0; i < length; i++)
+    {
+        if (line[i] == '\n')
+        {
+            line[i] = ' ';
+        }
+    }
+    line[length] = '\n';
+    history.pendingLength += length + 1;
+    storeHistory(line, length);
+    if (history.pendingLength >= HISTORY_BATCH)
+    {
+        flushHistory();
+    }
+}
+
+// Visits the entries containing text (starting with it when prefix is
+// set), newest first when backward is set; stops when visit returns 0
+void searchHistory(const char *text, int prefix, int backward, int (*visit)(long number, const char *line))
+{
+    size_t length = strlen(text);
+    struct historyPostings *rarest = NULL;
+
+    for (size_t i = 0; i + 3 <= length; i++)
+    {
+        struct historyPostings *postings = findHistoryPostings(historyTrigram(text + i), 0);
+        if (postings == NULL)
+        {
+            return; // some trigram occurs nowhere
+        }
+        if (rarest == NULL || postings->count - postings->start < rarest->count - rarest->start)
+        {
+            rarest = postings;
+        }
+    }
+
+    // Short queries have no trigram and scan the ring instead
+    size_t count = rarest != NULL ? rarest->count - rarest->start : (size_t)(history.next - history.first);
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t at = backward ? count - 1 - i : i;
+        long number = rarest != NULL ? rarest->numbers[rarest->start + at] : history.first + (long)at;
+        const char *line = historyLine(number);
+
+        if (line == NULL)
+        {
+            if (backward)
+            {
+                break; // everything older is evicted too
+            }
+            continue;
+        }
+        if (prefix ? strncmp(line, text, length) == 0 : strstr(line, text) != NULL)
+        {
+            if (!visit(number, line))
+            {
+                return;
             }
         }
     }
+}
+
+long historyMatch;
+
+int rememberHistoryMatch(long number, const char *line)
+{
+    (void)line;
+    historyMatch = number;
+    return 0;
+}
+
+int printHistoryMatch(long number, const char *line)
+{
+    printf("%5ld  %s\n", number, line);
+    return 1;
+}
+
+// !!, !n, !-n and !prefix at the start of a line recall an earlier command,
+// followed by the rest of the line. The result is echoed, lexed again and
+// becomes the command that runs and is recorded.
+int expandHistory()
+{
+    static char *expansion;
+    static size_t expansionCapacity;
+    const char *text = commandText;
+    const char *end = commandText + commandLength;
+
+    while (text < end && (*text == ' ' || *text == '\t'))
+    {
+        text++;
+    }
+    if (!history.enabled || end - text < 2 || text[0] != '!' || isspace((unsigned char)text[1]) || text[1] == '=')
+    {
+        return 0;
+    }
+    const char *eventEnd = text + 1;
+    while (eventEnd < end && !isspace((unsigned char)*eventEnd))
+    {
+        eventEnd++;
+    }
+
+    char event[MAX_PATH_SIZE];
+    snprintf(event, sizeof(event), "%.*s", (int)(eventEnd - text - 1), text + 1);
+    char *digitsEnd;
+    long number = strtol(event, &digitsEnd, 10);
+    if (strcmp(event, "!") == 0)
+    {
+        number = history.next - 1;
+    }
+    else if (*digitsEnd == '\0')
+    {
+        number = number < 0 ? history.next + number : number;
+    }
+    else
+    {
+        historyMatch = -1;
+        searchHistory(event, 1, 1, rememberHistoryMatch);
+        number = historyMatch;
+    }
+    const char *line = historyLine(number);
+    if (line == NULL)
+    {
+        fprintf(stderr, "myshell: !%s: event not found\n", event);
+        return -1;
+    }
 
-    args[ct] = NULL;
+    size_t lineLength = strlen(line);
+    size_t restLength = end - eventEnd;
+    if (lineLength + restLength + 1 > expansionCapacity)
+    {
+        expansionCapacity = lineLength + restLength + 1;
+        expansion = realloc(expansion, expansionCapacity);
+        if (expansion == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(expansion, line, lineLength);
+    memcpy(expansion + lineLength, eventEnd, restLength);
+    size_t length = lineLength + restLength;
+    while (length > 0 && isspace((unsigned char)expansion[length - 1]))
+    {
+        length--;
+    }
+    expansion[length] = '\0';
+    printf("%s\n", expansion);
+
+    if (lexCommand(&commandArena, expansion, length, &background) <= 0)
+    {
+        fprintf(stderr, "myshell: !%s: cannot run the recalled command\n", event);
+        return -1;
+    }
+    args = commandArena.args;
+    commandText = expansion;
+    commandLength = length;
+    return 0;
+}
+
+// history [N]: the last N entries (all kept ones by default);
+// history -s TEXT: the entries containing TEXT
+int historyCommand(char **args)
+{
+    if (args[1] != NULL && strcmp(args[1], "-s") == 0)
+    {
+        if (args[2] == NULL)
+        {
+            fprintf(stderr, "Usage: history [N] | history -s text\n");
+            return 2;
+        }
+        searchHistory(args[2], 0, 0, printHistoryMatch);
+        return 0;
+    }
+    long count = args[1] != NULL ? atol(args[1]) : history.next - history.first;
+    long from = history.next - count > history.first ? history.next - count : history.first;
+    for (long number = from; number < history.next; number++)
+    {
+        printf("%5ld  %s\n", number, historyLine(number));
+    }
+    return 0;
+}
+
+void executeCommand(char **args, int background)
+{
+    pid_t pid;
+    char fullPath[MAX_PATH_SIZE];
+
+    if (args[0] == NULL)
+    {
+        return;
+    }
+
+    // Resolve in the parent so the lookup lands in the exec cache
+    if (!findExecutable(args[0], fullPath))
+    {
+        perror("myshell");
+        lastStatus = 127;
+        return;
+    }
+
+    pid = fork();
+    if (pid == 0)
+    {
+        //  Child process
+        enterJobGroup(0, !background);
+        int execvResult = execv(fullPath, args);
+        if (execvResult == -1)
+        {
+            perror("myshell");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (pid < 0)
+    {
+        perror("myshell");
+        lastStatus = 1;
+    }
+    else
+    {
+        if (jobControl)
+        {
+            setpgid(pid, pid);
+        }
+        waitForChild(pid, background);
+    }
+}
+
+void waitForChild(pid_t pid, int background)
+{
+    waitForJob(&pid, 1, background);
+}
+
+// Records a job and waits for it in the foreground, or just reports it when
+// it runs in the background; the reaper collects it then
+void waitForJob(pid_t *pids, int count, int background)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    struct job *job = addJob(pids, count, background);
+    if (background)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            printf("[%d] Background process ID: %d\n", job->id, pids[i]);
+        }
+        lastStatus = 0;
+        return;
+    }
+    waitForegroundJob(job);
+}
+
+// Opens the redirection files in the shell, in the order applyRedirections()
+// does, so a file that cannot be opened is reported as such (status 1) rather
+// than as a failed spawn. fds[n] is -1 when fd n is not redirected.
+int openRedirections(const struct redirectSpec *spec, int fds[3])
+{
+    const char *files[3] = {spec->inFile, spec->outFile, spec->errFile};
+    int flags[3] = {O_RDONLY, spec->outFlags, O_CREAT | O_TRUNC | O_WRONLY};
+
+    for (int i = 0; i < 3; i++)
+    {
+        fds[i] = -1;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        if (files[i] != NULL && (fds[i] = open(files[i], flags[i] | O_CLOEXEC, 0666)) == -1)
+        {
+            perror("open");
+            closeRedirections(fds);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void closeRedirections(int fds[3])
+{
+    for (int i = 0; i < 3; i++)
+    {
+        if (fds[i] != -1)
+        {
+            close(fds[i]);
+            fds[i] = -1;
+        }
+    }
+}
+
+void addRedirectActions(posix_spawn_file_actions_t *actions, const int fds[3])
+{
+    for (int i = 0; i < 3; i++)
+    {
+        if (fds[i] != -1)
+        {
+            posix_spawn_file_actions_adddup2(actions, fds[i], i);
+        }
+    }
+}
+
+// Launches without copying the shell's address space: the path is resolved here,
+// redirections become spawn file actions and glibc starts the child with clone(CLONE_VM | CLONE_VFORK)
+void spawnCommand(char **args, int background)
+{
+    struct redirectSpec spec;
+    posix_spawn_file_actions_t actions;
+    char fullPath[MAX_PATH_SIZE];
+    int redirectFds[3];
+    pid_t pid;
+    int err;
+
+    if (parseRedirections(args, &spec) == -1 || args[0] == NULL)
+    {
+        lastStatus = 1;
+        return;
+    }
+
+    // As with the fork engine, the files are opened before the command is looked up
+    if (openRedirections(&spec, redirectFds) == -1)
+    {
+        lastStatus = 1;
+        return;
+    }
+    if (!findExecutable(args[0], fullPath))
+    {
+        perror("myshell");
+        closeRedirections(redirectFds);
+        lastStatus = 127;
+        return;
+    }
+
+    posix_spawn_file_actions_init(&actions);
+    setSpawnGroup(&actions, 0, !background);
+    addRedirectActions(&actions, redirectFds);
+    err = posix_spawn(&pid, fullPath, &actions, &spawnAttr, args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    closeRedirections(redirectFds);
+
+    if (err != 0)
+    {
+        fprintf(stderr, "myshell: %s: %s\n", args[0], strerror(err));
+        lastStatus = err == ENOENT ? 127 : 126;
+        return;
+    }
+
+    waitForChild(pid, background);
+}
+
+int isPipeline(char **args)
+{
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        if (args[i] == pipeOperator)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Starts one pipeline stage reading from inFd and writing to outFd (-1 keeps the shell's own).
+// The stage's own redirections are applied after the pipe ends so they take precedence.
+// Under job control it joins process group pgid, or leads a new one when pgid is 0.
+int startStage(char **stageArgs, int inFd, int outFd, pid_t pgid, int foreground, pid_t *pid)
+{
+    struct redirectSpec spec;
+    char fullPath[MAX_PATH_SIZE];
+
+    if (parseRedirections(stageArgs, &spec) == -1)
+    {
+        return -1;
+    }
+    if (stageArgs[0] == NULL)
+    {
+        fprintf(stderr, "myshell: syntax error near unexpected token `|'\n");
+        return -1;
+    }
+    const struct builtin *builtin = findBuiltin(stageArgs[0]);
+    if (builtin != NULL)
+    {
+        return launchBuiltinStage(builtin, stageArgs, &spec, inFd, outFd, pgid, foreground, pid);
+    }
+    if (!findExecutable(stageArgs[0], fullPath))
+    {
+        fprintf(stderr, "myshell: %s: %s\n", stageArgs[0], strerror(errno));
+        return -1;
+    }
+    return launchStage(stageArgs, &spec, fullPath, inFd, outFd, pgid, foreground, pid);
+}
+
+// startStage() once the redirections are parsed and the path is resolved
+int launchStage(char **stageArgs, const struct redirectSpec *spec, const char *fullPath, int inFd, int outFd, pid_t pgid,
+                int foreground, pid_t *pid)
+{
+    if (launchMode == LAUNCH_SPAWN)
+    {
+        posix_spawn_file_actions_t actions;
+        int redirectFds[3];
+        int err;
+
+        if (openRedirections(spec, redirectFds) == -1)
+        {
+            // As a forked stage whose redirection fails: it exits 1 and the
+            // rest of the pipeline still runs
+            *pid = fork();
+            if (*pid == 0)
+            {
+                enterJobGroup(pgid, foreground);
+                _exit(EXIT_FAILURE);
+            }
+            else if (*pid < 0)
+            {
+                perror("myshell");
+                return -1;
+            }
+            if (jobControl)
+            {
+                setpgid(*pid, pgid != 0 ? pgid : *pid);
+            }
+            return 0;
+        }
+        posix_spawn_file_actions_init(&actions);
+        setSpawnGroup(&actions, pgid, foreground);
+        if (inFd != -1)
+        {
+            posix_spawn_file_actions_adddup2(&actions, inFd, STDIN_FILENO);
+        }
+        if (outFd != -1)
+        {
+            posix_spawn_file_actions_adddup2(&actions, outFd, STDOUT_FILENO);
+        }
+        addRedirectActions(&actions, redirectFds);
+        err = posix_spawn(pid, fullPath, &actions, &spawnAttr, stageArgs, environ);
+        posix_spawn_file_actions_destroy(&actions);
+        closeRedirections(redirectFds);
+
+        if (err != 0)
+        {
+            fprintf(stderr, "myshell: %s: %s\n", stageArgs[0], strerror(err));
+            return -1;
+        }
+        return 0;
+    }
+
+    *pid = fork();
+    if (*pid == 0)
+    {
+        enterJobGroup(pgid, foreground);
+        if (inFd != -1)
+        {
+            dup2(inFd, STDIN_FILENO);
+        }
+        if (outFd != -1)
+        {
+            dup2(outFd, STDOUT_FILENO);
+        }
+        if (applyRedirections(spec) == -1)
+        {
+            exit(EXIT_FAILURE);
+        }
+        execv(fullPath, stageArgs);
+        perror("myshell");
+        exit(EXIT_FAILURE);
+    }
+    else if (*pid < 0)
+    {
+        perror("myshell");
+        return -1;
+    }
+    if (jobControl)
+    {
+        setpgid(*pid, pgid != 0 ? pgid : *pid);
+    }
+    return 0;
+}
+
+// A builtin stage runs in a forked copy of the shell, so it reads and writes
+// the pipes while the other stages run and cannot change the shell's own state
+int launchBuiltinStage(const struct builtin *builtin, char **stageArgs, const struct redirectSpec *spec, int inFd,
+                       int outFd, pid_t pgid, int foreground, pid_t *pid)
+{
+    // Or the child would print what the shell still has buffered
+    fflush(stdout);
+    fflush(stderr);
+
+    *pid = fork();
+    if (*pid == 0)
+    {
+        enterJobGroup(pgid, foreground);
+        // Whatever the builtin starts stays in this stage's process group
+        jobControl = 0;
+        if (inFd != -1)
+        {
+            dup2(inFd, STDIN_FILENO);
+        }
+        if (outFd != -1)
+        {
+            dup2(outFd, STDOUT_FILENO);
+        }
+        if (applyRedirections(spec) == -1)
+        {
+            _exit(EXIT_FAILURE);
+        }
+        int status = builtin->run(stageArgs);
+        fflush(stdout);
+        fflush(stderr);
+        _exit(status);
+    }
+    else if (*pid < 0)
+    {
+        perror("myshell");
+        return -1;
+    }
+    if (jobControl)
+    {
+        setpgid(*pid, pgid != 0 ? pgid : *pid);
+    }
+    return 0;
+}
+
+// a | b | c: every stage is started before any is waited for, connected by
+// close-on-exec pipes so no stage keeps another pipe's write end open
+void runPipeline(char **args, int background)
+{
+    int stageCount = 1;
+    int started = 0;
+    int prevRead = -1;
+
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        if (args[i] == pipeOperator)
+        {
+            stageCount++;
+        }
+    }
+
+    char ***stages = malloc(stageCount * sizeof(char **));
+    pid_t *pids = malloc(stageCount * sizeof(pid_t));
+    if (stages == NULL || pids == NULL)
+    {
+        perror("malloc");
+        free(stages);
+        free(pids);
+        return;
+    }
+
+    int stage = 0;
+    stages[stage++] = args;
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        if (args[i] == pipeOperator)
+        {
+            args[i] = NULL;
+            stages[stage++] = &args[i + 1];
+        }
+    }
+
+    for (int i = 0; i < stageCount; i++)
+    {
+        int fds[2] = {-1, -1};
+
+        if (i < stageCount - 1 && pipe2(fds, O_CLOEXEC) == -1)
+        {
+            perror("pipe2");
+            break;
+        }
+
+        int result = startStage(stages[i], prevRead, fds[1], started > 0 ? pids[0] : 0, !background, &pids[started]);
+
+        if (prevRead != -1)
+        {
+            close(prevRead);
+        }
+        if (fds[1] != -1)
+        {
+            close(fds[1]);
+        }
+        prevRead = fds[0];
+
+        if (result == -1)
+        {
+            break;
+        }
+        started++;
+    }
+
+    if (prevRead != -1)
+    {
+        close(prevRead);
+    }
+
+    waitForJob(pids, started, background);
+    if (started < stageCount)
+    {
+        lastStatus = 1;
+    }
+
+    free(stages);
+    free(pids);
+}
+
+// launch              -> print the current launch engine
+// launch fork|spawn   -> switch engines
+int launchCommand(char **args)
+{
+    if (args[1] == NULL)
+    {
+        printf("%s\n", launchMode == LAUNCH_SPAWN ? "spawn" : "fork");
+    }
+    else if (strcmp(args[1], "spawn") == 0)
+    {
+        launchMode = LAUNCH_SPAWN;
+    }
+    else if (strcmp(args[1], "fork") == 0)
+    {
+        launchMode = LAUNCH_FORK;
+    }
+    else
+    {
+        fprintf(stderr, "Usage: launch [fork|spawn]\n");
+        return 1;
+    }
+    return 0;
+}
+
+unsigned int hashString(const char *str)
+{
+    unsigned int hash = 5381;
+
+    while (*str)
+    {
+        hash = hash * 33 + (unsigned char)*str++;
+    }
+    return hash;
+}
+
+void flushExecCache()
+{
+    for (int i = 0; i < EXEC_CACHE_BUCKETS; i++)
+    {
+        struct execCacheEntry *entry = execCache[i];
+        while (entry != NULL)
+        {
+            struct execCacheEntry *next = entry->next;
+            free(entry->command);
+            free(entry->fullPath);
+            free(entry);
+            entry = next;
+        }
+        execCache[i] = NULL;
+    }
+}
+
+struct execCacheEntry *lookupExecCache(const char *command)
+{
+    struct execCacheEntry *entry = execCache[hashString(command) % EXEC_CACHE_BUCKETS];
+
+    while (entry != NULL && strcmp(entry->command, command) != 0)
+    {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+void removeExecCache(const char *command)
+{
+    struct execCacheEntry **link = &execCache[hashString(command) % EXEC_CACHE_BUCKETS];
+
+    while (*link != NULL)
+    {
+        struct execCacheEntry *entry = *link;
+        if (strcmp(entry->command, command) == 0)
+        {
+            *link = entry->next;
+            free(entry->command);
+            free(entry->fullPath);
+            free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+struct execCacheEntry *insertExecCache(const char *command, const char *fullPath)
+{
+    unsigned int bucket = hashString(command) % EXEC_CACHE_BUCKETS;
+    struct execCacheEntry *entry = malloc(sizeof(struct execCacheEntry));
+
+    if (entry == NULL)
+    {
+        return NULL;
+    }
+    entry->command = strdup(command);
+    entry->fullPath = strdup(fullPath);
+    entry->hits = 0;
+    entry->next = execCache[bucket];
+    execCache[bucket] = entry;
+    return entry;
+}
+
+// Drops the whole cache when PATH is not the one the entries were resolved against
+void checkExecCachePath(const char *pathEnv)
+{
+    if (execCachePath != NULL && strcmp(execCachePath, pathEnv) == 0)
+    {
+        return;
+    }
+    flushExecCache();
+    free(execCachePath);
+    execCachePath = strdup(pathEnv);
+}
+
+// Walks PATH without consulting the cache
+int searchPath(const char *pathEnv, const char *command, char *fullPath)
+{
+    char *path = strdup(pathEnv);
+
+    char *token = strtok(path, ":");
+
+    while (token != NULL)
+    {
+
+        snprintf(fullPath, MAX_PATH_SIZE, "%s/%s", token, command);
+
+        if (access(fullPath, X_OK) == 0)
+        {
+            free(path);
+            return 1;
+        }
+
+        token = strtok(NULL, ":");
+    }
+
+    free(path);
+    return 0;
+}
+
+int findExecutable(const char *command, char *fullPath)
+{
+    // Paths are used as they are and never cached
+    if (strchr(command, '/') != NULL)
+    {
+        snprintf(fullPath, MAX_PATH_SIZE, "%s", command);
+        return access(fullPath, X_OK) == 0;
+    }
+
+    char *pathEnv = getenv("PATH");
+    if (pathEnv == NULL)
+    {
+        perror("getenv");
+        return 0;
+    }
+
+    checkExecCachePath(pathEnv);
+
+    struct execCacheEntry *entry = lookupExecCache(command);
+    if (entry != NULL)
+    {
+        // One access() instead of a PATH walk; a vanished binary invalidates the entry
+        if (access(entry->fullPath, X_OK) == 0)
+        {
+            entry->hits++;
+            snprintf(fullPath, MAX_PATH_SIZE, "%s", entry->fullPath);
+            return 1;
+        }
+        removeExecCache(command);
+    }
+
+    if (!searchPath(pathEnv, command, fullPath))
+    {
+        return 0;
+    }
+
+    entry = insertExecCache(command, fullPath);
+    if (entry != NULL)
+    {
+        entry->hits++;
+    }
+    return 1;
+}
+
+// hash       -> list cached commands
+// hash -r    -> forget every cached location
+// hash name  -> resolve and remember name without running it
+int hashCommand(char **args)
+{
+    char fullPath[MAX_PATH_SIZE];
+
+    if (args[1] == NULL)
+    {
+        int empty = 1;
+        for (int i = 0; i < EXEC_CACHE_BUCKETS; i++)
+        {
+            for (struct execCacheEntry *entry = execCache[i]; entry != NULL; entry = entry->next)
+            {
+                if (empty)
+                {
+                    printf("hits\tcommand\n");
+                    empty = 0;
+                }
+                printf("%4d\t%s\n", entry->hits, entry->fullPath);
+            }
+        }
+        if (empty)
+        {
+            printf("hash: hash table empty\n");
+        }
+        return 0;
+    }
+
+    if (strcmp(args[1], "-r") == 0)
+    {
+        flushExecCache();
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (strchr(args[i], '/') != NULL)
+        {
+            continue;
+        }
+        if (!findExecutable(args[i], fullPath))
+        {
+            fprintf(stderr, "hash: %s: not found\n", args[i]);
+            status = 1;
+            continue;
+        }
+        // Adding a command is not a use of it
+        struct execCacheEntry *entry = lookupExecCache(args[i]);
+        if (entry != NULL)
+        {
+            entry->hits--;
+        }
+    }
+    return status;
+}
+
+// Result sinks: each worker formats its matches into a private buffer that is
+// written out in large pieces under ctx->outputLock, so workers never
+// interleave partial lines and stdout sees few, large writes.
+int writeAll(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t n = writev(fd, iov, count < IOV_MAX ? count : IOV_MAX);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            return -1;
+        }
+        // Skip what was written, possibly ending inside an iovec
+        while (count > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// On allocation failure the bytes are dropped and so is everything appended
+// after them until the next flush, which reports the loss
+void sinkAppend(struct resultSink *sink, const char *bytes, size_t len)
+{
+    if (sink->failed)
+    {
+        return;
+    }
+    if (sink->length + len > sink->capacity)
+    {
+        size_t capacity = sink->capacity ? sink->capacity : SINK_FLUSH_SIZE;
+        while (sink->length + len > capacity)
+        {
+            capacity *= 2;
+        }
+        char *grown = realloc(sink->data, capacity);
+        if (grown == NULL)
+        {
+            perror("realloc");
+            sink->failed = 1;
+            return;
+        }
+        sink->data = grown;
+        sink->capacity = capacity;
+    }
+    memcpy(sink->data + sink->length, bytes, len);
+    sink->length += len;
+}
+
+// Writes sink; the caller holds outputLock
+void writeResultSink(struct searchContext *ctx, struct resultSink *sink)
+{
+    struct iovec iov = {sink->data, sink->length};
+
+    if (sink->length > 0 && writeAll(STDOUT_FILENO, &iov, 1) == -1)
+    {
+        perror("write");
+    }
+    if (sink->failed)
+    {
+        if (atomic_exchange(&ctx->dropped, 1) == 0)
+        {
+            fprintf(stderr, "search: out of memory, some matches were not printed\n");
+        }
+        sink->failed = 0;
+    }
+    sink->length = 0;
+}
+
+void flushResultSink(struct searchContext *ctx, struct resultSink *sink)
+{
+    if (sink->length == 0 && !sink->failed)
+    {
+        return;
+    }
+    pthread_mutex_lock(&ctx->outputLock);
+    writeResultSink(ctx, sink);
+    pthread_mutex_unlock(&ctx->outputLock);
+}
+
+// pattern names the matching pattern when several are searched for at once
+void emitMatch(struct searchWorker *worker, size_t lineNumber, const char *filePath, const char *pattern,
+               const char *line, size_t lineLength)
+{
+    char prefix[32];
+    int prefixLength = snprintf(prefix, sizeof(prefix), "%-5zu: ", lineNumber);
+
+    sinkAppend(&worker->sink, prefix, prefixLength);
+    sinkAppend(&worker->sink, filePath, strlen(filePath));
+    if (pattern != NULL)
+    {
+        sinkAppend(&worker->sink, " [", 2);
+        sinkAppend(&worker->sink, pattern, strlen(pattern));
+        sinkAppend(&worker->sink, "]", 1);
+    }
+    sinkAppend(&worker->sink, " -> ", 4);
+    sinkAppend(&worker->sink, line, lineLength);
+    sinkAppend(&worker->sink, "\n", 1);
+}
+
+// Adds one match to the output of the current mode; returns 0 once no more
+// matches of the file are wanted
+int reportMatch(struct searchWorker *worker, size_t matchCount, size_t lineNumber, const char *filePath,
+                int pattern, const char *line, size_t lineLength)
+{
+    struct searchContext *ctx = worker->ctx;
+    const struct searchOptions *options = ctx->options;
+
+    atomic_store_explicit(&ctx->matched, 1, memory_order_relaxed);
+    switch (options->outputMode)
+    {
+    case OUTPUT_QUIET:
+        atomic_store(&ctx->stopped, 1);
+        return 0;
+    case OUTPUT_FILES:
+        sinkAppend(&worker->sink, filePath, strlen(filePath));
+        sinkAppend(&worker->sink, "\n", 1);
+        return 0;
+    case OUTPUT_COUNT:
+        break;
+    default:
+        emitMatch(worker, lineNumber, filePath, pattern >= 0 ? options->patterns[pattern] : NULL, line, lineLength);
+        break;
+    }
+    return options->maxCount == 0 || matchCount < options->maxCount;
+}
+
+// Called once a file's matches are all in the sink, which is flushed once it
+// is large enough; a --sorted window's sink is the file's and left alone
+void finishFileOutput(struct searchWorker *worker, const char *filePath, size_t matchCount)
+{
+    struct resultSink *sink = &worker->sink;
+
+    if (worker->ctx->options->outputMode == OUTPUT_COUNT && matchCount > 0)
+    {
+        char count[32];
+        int countLength = snprintf(count, sizeof(count), ":%zu\n", matchCount);
+        sinkAppend(sink, filePath, strlen(filePath));
+        sinkAppend(sink, count, countLength);
+    }
+
+    if (worker->ctx->ordered == NULL && sink->length >= SINK_FLUSH_SIZE)
+    {
+        flushResultSink(worker->ctx, sink);
+    }
+}
+
+// Writes whatever the workers still hold
+void flushSearchOutput(struct searchContext *ctx)
+{
+    for (int i = 0; i < ctx->workerCount; i++)
+    {
+        flushResultSink(ctx, &ctx->workers[i].sink);
+    }
+}
+
+// Literal scanning engine: candidates are positions where both the first and the
+// last byte of the pattern match, tested a whole vector at a time; only those
+// candidates are compared in full.
+const char *scanLiteralScalar(const char *text, size_t len, const char *needle, size_t needleLen)
+{
+    const char *end = text + len;
+
+    while ((size_t)(end - text) >= needleLen)
+    {
+        const char *candidate = memchr(text, needle[0], end - text - needleLen + 1);
+        if (candidate == NULL)
+        {
+            return NULL;
+        }
+        if (memcmp(candidate, needle, needleLen) == 0)
+        {
+            return candidate;
+        }
+        text = candidate + 1;
+    }
+    return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+const char *scanLiteralSse2(const char *text, size_t len, const char *needle, size_t needleLen)
+{
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needleLen - 1]);
+    size_t i = 0;
+
+    if (len < needleLen)
+    {
+        return NULL;
+    }
+
+    // Every candidate start in [i, i + 16) keeps its last byte inside the text
+    for (; i + 16 + needleLen - 1 <= len; i += 16)
+    {
+        __m128i blockFirst = _mm_loadu_si128((const __m128i *)(text + i));
+        __m128i blockLast = _mm_loadu_si128((const __m128i *)(text + i + needleLen - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(first, blockFirst),
+                                                            _mm_cmpeq_epi8(last, blockLast)));
+        while (mask != 0)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(text + i + bit, needle, needleLen) == 0)
+            {
+                return text + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return scanLiteralScalar(text + i, len - i, needle, needleLen);
+}
+
+__attribute__((target("avx2"))) const char *scanLiteralAvx2(const char *text, size_t len, const char *needle, size_t needleLen)
+{
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[needleLen - 1]);
+    size_t i = 0;
+
+    if (len < needleLen)
+    {
+        return NULL;
+    }
+
+    for (; i + 32 + needleLen - 1 <= len; i += 32)
+    {
+        __m256i blockFirst = _mm256_loadu_si256((const __m256i *)(text + i));
+        __m256i blockLast = _mm256_loadu_si256((const __m256i *)(text + i + needleLen - 1));
+        unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(first, blockFirst),
+                                                                               _mm256_cmpeq_epi8(last, blockLast)));
+        while (mask != 0)
+        {
+            int bit = __builtin_ctz(mask);
+            if (memcmp(text + i + bit, needle, needleLen) == 0)
+            {
+                return text + i + bit;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return scanLiteralSse2(text + i, len - i, needle, needleLen);
+}
+#endif
+
+// Picks the widest engine the CPU supports; MYSHELL_SCAN=scalar|sse2|avx2 overrides it
+void selectScanEngine()
+{
+    char *engine = getenv("MYSHELL_SCAN");
+
+    scanLiteral = scanLiteralScalar;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (engine != NULL && strcmp(engine, "scalar") == 0)
+    {
+        return;
+    }
+    scanLiteral = scanLiteralSse2;
+    if (engine != NULL && strcmp(engine, "sse2") == 0)
+    {
+        return;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        scanLiteral = scanLiteralAvx2;
+    }
+#else
+    (void)engine;
+#endif
+}
+
+size_t countNewlines(const char *text, size_t len)
+{
+    const char *end = text + len;
+    size_t count = 0;
+
+    while ((text = memchr(text, '\n', end - text)) != NULL)
+    {
+        count++;
+        text++;
+    }
+    return count;
+}
+
+// Aho-Corasick automaton for -e/-F pattern sets, flattened into a full DFA so
+// scanning costs one table lookup per byte whatever the number of patterns.
+// Its columns are byte classes, not bytes: every byte that occurs in no
+// pattern moves the automaton the same way, so they share one column and a
+// state costs 4 bytes per distinct pattern byte instead of 1KB.
+int addAutomatonState(struct ahoCorasick *ac)
+{
+    if (ac->stateCount == ac->stateCapacity)
+    {
+        int capacity = ac->stateCapacity ? ac->stateCapacity * 2 : 256;
+        int32_t *delta = realloc(ac->delta, (size_t)capacity * ac->classCount * sizeof(int32_t));
+        if (delta == NULL)
+        {
+            perror("realloc");
+            return -1;
+        }
+        ac->delta = delta;
+        int32_t *output = realloc(ac->output, capacity * sizeof(int32_t));
+        if (output == NULL)
+        {
+            perror("realloc");
+            return -1;
+        }
+        ac->output = output;
+        int32_t *fail = realloc(ac->fail, capacity * sizeof(int32_t));
+        if (fail == NULL)
+        {
+            perror("realloc");
+            return -1;
+        }
+        ac->fail = fail;
+        ac->stateCapacity = capacity;
+    }
+    int state = ac->stateCount++;
+    for (int c = 0; c < ac->classCount; c++)
+    {
+        ac->delta[(size_t)state * ac->classCount + c] = -1;
+    }
+    ac->output[state] = -1;
+    ac->fail[state] = 0;
+    return state;
+}
+
+// Returns NULL if memory runs out
+struct ahoCorasick *buildAhoCorasick(char **patterns, int patternCount)
+{
+    struct ahoCorasick *ac = calloc(1, sizeof(struct ahoCorasick));
+    if (ac == NULL)
+    {
+        perror("calloc");
+        return NULL;
+    }
+    ac->patterns = patterns;
+    ac->patternLengths = malloc(patternCount * sizeof(size_t));
+    if (ac->patternLengths == NULL)
+    {
+        perror("malloc");
+        free(ac);
+        return NULL;
+    }
+    ac->classCount = 1;
+    ac->emptyPattern = -1;
+    for (int p = 0; p < patternCount; p++)
+    {
+        ac->patternLengths[p] = strlen(patterns[p]);
+        if (ac->patternLengths[p] == 0 && ac->emptyPattern == -1)
+        {
+            ac->emptyPattern = p;
+        }
+        for (size_t i = 0; i < ac->patternLengths[p]; i++)
+        {
+            unsigned char c = patterns[p][i];
+            if (ac->byteClass[c] == 0)
+            {
+                ac->byteClass[c] = ac->classCount++;
+            }
+        }
+    }
+    int classCount = ac->classCount;
+    if (addAutomatonState(ac) == -1)
+    {
+        freeAhoCorasick(ac);
+        return NULL;
+    }
+
+    // Trie; a state keeps the shortest pattern ending there
+    for (int p = 0; p < patternCount; p++)
+    {
+        int state = 0;
+        for (size_t i = 0; i < ac->patternLengths[p]; i++)
+        {
+            int c = ac->byteClass[(unsigned char)patterns[p][i]];
+            if (ac->delta[(size_t)state * classCount + c] == -1)
+            {
+                int next = addAutomatonState(ac);
+                if (next == -1)
+                {
+                    freeAhoCorasick(ac);
+                    return NULL;
+                }
+                ac->delta[(size_t)state * classCount + c] = next;
+            }
+            state = ac->delta[(size_t)state * classCount + c];
+        }
+        // An output on the root would spread to every state through the failure links
+        if (state != 0 && ac->output[state] == -1)
+        {
+            ac->output[state] = p;
+        }
+    }
+
+    // Breadth-first: fill failure links and turn missing edges into the failure state's edges
+    int *queue = malloc(ac->stateCount * sizeof(int));
+    int head = 0, tail = 0;
+    if (queue == NULL)
+    {
+        perror("malloc");
+        freeAhoCorasick(ac);
+        return NULL;
+    }
+    for (int c = 0; c < classCount; c++)
+    {
+        int next = ac->delta[c];
+        if (next == -1)
+        {
+            ac->delta[c] = 0;
+        }
+        else
+        {
+            ac->fail[next] = 0;
+            queue[tail++] = next;
+        }
+    }
+    while (head < tail)
+    {
+        int state = queue[head++];
+        if (ac->output[state] == -1)
+        {
+            ac->output[state] = ac->output[ac->fail[state]];
+        }
+        for (int c = 0; c < classCount; c++)
+        {
+            int next = ac->delta[(size_t)state * classCount + c];
+            int fallback = ac->delta[(size_t)ac->fail[state] * classCount + c];
+            if (next == -1)
+            {
+                ac->delta[(size_t)state * classCount + c] = fallback;
+            }
+            else
+            {
+                ac->fail[next] = fallback;
+                queue[tail++] = next;
+            }
+        }
+    }
+    free(queue);
+    return ac;
+}
+
+void freeAhoCorasick(struct ahoCorasick *ac)
+{
+    if (ac != NULL)
+    {
+        free(ac->delta);
+        free(ac->output);
+        free(ac->fail);
+        free(ac->patternLengths);
+        free(ac);
+    }
+}
+
+// Start of the first match ending in [text, end), with its pattern in *pattern.
+// With an empty pattern in the set every line matches: text (a line start) is
+// returned, tagged with a non-empty pattern when one occurs on that line.
+const char *scanAhoCorasick(const struct ahoCorasick *ac, const char *text, const char *end, int *pattern)
+{
+    int state = 0;
+
+    if (ac->emptyPattern != -1)
+    {
+        const char *lineEnd = memchr(text, '\n', end - text);
+        *pattern = ac->emptyPattern;
+        end = lineEnd != NULL ? lineEnd : end;
+        for (const char *p = text; p < end; p++)
+        {
+            state = ac->delta[(size_t)state * ac->classCount + ac->byteClass[(unsigned char)*p]];
+            if (ac->output[state] != -1)
+            {
+                *pattern = ac->output[state];
+                break;
+            }
+        }
+        return text;
+    }
+    for (const char *p = text; p < end; p++)
+    {
+        state = ac->delta[(size_t)state * ac->classCount + ac->byteClass[(unsigned char)*p]];
+        if (ac->output[state] != -1)
+        {
+            *pattern = ac->output[state];
+            return p + 1 - ac->patternLengths[*pattern];
+        }
+    }
+    return NULL;
+}
+
+// Next match of the search's pattern(s) in [pos, end)
+const char *findNextMatch(struct searchWorker *worker, const char *pos, const char *end, int *pattern)
+{
+    struct searchContext *ctx = worker->ctx;
+
+    if (ctx->regex != NULL)
+    {
+        *pattern = 0;
+        return scanRegex(worker, pos, end);
+    }
+    if (ctx->automaton != NULL)
+    {
+        return scanAhoCorasick(ctx->automaton, pos, end, pattern);
+    }
+    *pattern = 0;
+    if (ctx->searchLength == 0)
+    {
+        return pos;
+    }
+    return scanLiteral(pos, end - pos, ctx->options->searchString, ctx->searchLength);
+}
+
+// -F file: one pattern per line, blank lines ignored
+int readPatternFile(const char *fileName, struct searchOptions *options)
+{
+    FILE *file = fopen(fileName, "r");
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+
+    if (file == NULL)
+    {
+        perror(fileName);
+        return -1;
+    }
+    while ((length = getline(&line, &size, file)) != -1)
+    {
+        if (length > 0 && line[length - 1] == '\n')
+        {
+            line[--length] = '\0';
+        }
+        if (length > 0 && line[length - 1] == '\r')
+        {
+            line[--length] = '\0';
+        }
+        if (length > 0)
+        {
+            addSearchPattern(options, strdup(line), 1);
+        }
+    }
+    free(line);
+    fclose(file);
+    return 0;
+}
+
+void addSearchPattern(struct searchOptions *options, char *pattern, int owned)
+{
+    if (options->patternCount == options->patternCapacity)
+    {
+        options->patternCapacity = options->patternCapacity ? options->patternCapacity * 2 : 8;
+        options->patterns = realloc(options->patterns, options->patternCapacity * sizeof(char *));
+        options->ownedPatterns = realloc(options->ownedPatterns, options->patternCapacity);
+        if (options->patterns == NULL || options->ownedPatterns == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    options->ownedPatterns[options->patternCount] = owned;
+    options->patterns[options->patternCount++] = pattern;
+}
+
+void freeSearchPatterns(struct searchOptions *options)
+{
+    for (int i = 0; i < options->patternCount; i++)
+    {
+        if (options->ownedPatterns[i])
+        {
+            free(options->patterns[i]);
+        }
+    }
+    free(options->patterns);
+    free(options->ownedPatterns);
+}
+
+// Regular expressions for search -E: the pattern (POSIX ERE syntax: . [] ()
+// | * + ? {m,n} ^ $ and \d \w \s escapes) is parsed into a tree, compiled to a
+// Thompson NFA and run through a DFA whose states are built lazily, per worker,
+// the first time a (state, byte) pair is seen. Matching is linear in the input.
+struct regexNode *newRegexNode(int type)
+{
+    struct regexNode *node = calloc(1, sizeof(struct regexNode));
+    if (node == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    node->type = type;
+    return node;
+}
+
+void freeRegexNode(struct regexNode *node)
+{
+    if (node != NULL)
+    {
+        freeRegexNode(node->left);
+        freeRegexNode(node->right);
+        free(node);
+    }
+}
+
+void setClassRange(unsigned char *set, int from, int to)
+{
+    for (int c = from; c <= to; c++)
+    {
+        set[c >> 3] |= 1 << (c & 7);
+    }
+}
+
+// \d \w \s and their negations; returns 0 if c is not a class escape
+int setClassEscape(unsigned char *set, char c)
+{
+    unsigned char tmp[32];
+    int negate = isupper((unsigned char)c);
+
+    memset(tmp, 0, sizeof(tmp));
+    switch (tolower((unsigned char)c))
+    {
+    case 'd':
+        setClassRange(tmp, '0', '9');
+        break;
+    case 'w':
+        setClassRange(tmp, '0', '9');
+        setClassRange(tmp, 'a', 'z');
+        setClassRange(tmp, 'A', 'Z');
+        setClassRange(tmp, '_', '_');
+        break;
+    case 's':
+        setClassRange(tmp, ' ', ' ');
+        setClassRange(tmp, '\t', '\r');
+        break;
+    default:
+        return 0;
+    }
+    for (int i = 0; i < 32; i++)
+    {
+        set[i] |= negate ? (unsigned char)~tmp[i] : tmp[i];
+    }
+    return 1;
+}
+
+// [:name:] inside a bracket expression, C locale; returns 0 for an unknown name
+int setPosixClass(unsigned char *set, const char *name, size_t length)
+{
+    static const struct
+    {
+        const char *name;
+        int (*test)(int c);
+    } classes[] = {
+        {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank}, {"cntrl", iscntrl},
+        {"digit", isdigit}, {"graph", isgraph}, {"lower", islower}, {"print", isprint},
+        {"punct", ispunct}, {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+    };
+
+    for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++)
+    {
+        if (strlen(classes[i].name) == length && strncmp(classes[i].name, name, length) == 0)
+        {
+            for (int c = 0; c < 128; c++)
+            {
+                if (classes[i].test(c))
+                {
+                    setClassRange(set, c, c);
+                }
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int escapedChar(char c)
+{
+    switch (c)
+    {
+    case 't':
+        return '\t';
+    case 'n':
+        return '\n';
+    case 'r':
+        return '\r';
+    default:
+        return (unsigned char)c;
+    }
+}
+
+struct regexNode *parseRegexAlternation(struct regexParser *parser);
+
+struct regexNode *parseRegexAtom(struct regexParser *parser)
+{
+    const char *p = parser->pos;
+    struct regexNode *node;
+
+    if (*p == '(')
+    {
+        parser->pos++;
+        node = parseRegexAlternation(parser);
+        if (node == NULL)
+        {
+            return NULL;
+        }
+        if (*parser->pos != ')')
+        {
+            parser->error = "missing )";
+            freeRegexNode(node);
+            return NULL;
+        }
+        parser->pos++;
+        return node;
+    }
+    if (*p == '^' || *p == '$')
+    {
+        parser->pos++;
+        return newRegexNode(*p == '^' ? REGEX_BOL : REGEX_EOL);
+    }
+
+    node = newRegexNode(REGEX_CHARSET);
+    if (*p == '.')
+    {
+        setClassRange(node->set, 0, 255);
+        node->set['\n' >> 3] &= ~(1 << ('\n' & 7));
+        parser->pos++;
+    }
+    else if (*p == '[')
+    {
+        int negate = 0;
+        p++;
+        if (*p == '^')
+        {
+            negate = 1;
+            p++;
+        }
+        // A leading ] is a literal
+        const char *first = p;
+        while (*p != '\0' && (*p != ']' || p == first))
+        {
+            int from;
+            if (*p == '[' && (p[1] == ':' || p[1] == '=' || p[1] == '.'))
+            {
+                const char *close = strstr(p + 2, p[1] == ':' ? ":]" : p[1] == '=' ? "=]" : ".]");
+                if (p[1] != ':' || close == NULL || !setPosixClass(node->set, p + 2, close - p - 2))
+                {
+                    parser->error = p[1] != ':' ? "collating elements are not supported" : "unknown character class";
+                    freeRegexNode(node);
+                    return NULL;
+                }
+                p = close + 2;
+                continue;
+            }
+            if (*p == '\\' && p[1] != '\0')
+            {
+                if (setClassEscape(node->set, p[1]))
+                {
+                    p += 2;
+                    continue;
+                }
+                from = escapedChar(p[1]);
+                p += 2;
+            }
+            else
+            {
+                from = (unsigned char)*p++;
+            }
+            if (*p == '-' && p[1] != ']' && p[1] != '\0')
+            {
+                int to = (unsigned char)p[1];
+                p += 2;
+                if (to < from)
+                {
+                    parser->error = "invalid range in []";
+                    freeRegexNode(node);
+                    return NULL;
+                }
+                setClassRange(node->set, from, to);
+            }
+            else
+            {
+                setClassRange(node->set, from, from);
+            }
+        }
+        if (*p != ']')
+        {
+            parser->error = "missing ]";
+            freeRegexNode(node);
+            return NULL;
+        }
+        if (negate)
+        {
+            for (int i = 0; i < 32; i++)
+            {
+                node->set[i] = ~node->set[i];
+            }
+            node->set['\n' >> 3] &= ~(1 << ('\n' & 7));
+        }
+        parser->pos = p + 1;
+    }
+    else if (*p == '\\')
+    {
+        if (p[1] == '\0')
+        {
+            parser->error = "trailing \\";
+            freeRegexNode(node);
+            return NULL;
+        }
+        if (!setClassEscape(node->set, p[1]))
+        {
+            setClassRange(node->set, escapedChar(p[1]), escapedChar(p[1]));
+        }
+        parser->pos += 2;
+    }
+    else if (*p == '*' || *p == '+' || *p == '?' || *p == '{')
+    {
+        parser->error = "repetition operator without operand";
+        freeRegexNode(node);
+        return NULL;
+    }
+    else
+    {
+        setClassRange(node->set, (unsigned char)*p, (unsigned char)*p);
+        parser->pos++;
+    }
+    return node;
+}
+
+struct regexNode *parseRegexRepeat(struct regexParser *parser)
+{
+    struct regexNode *node = parseRegexAtom(parser);
+
+    while (node != NULL)
+    {
+        char c = *parser->pos;
+        int min, max;
+
+        if (c == '*' || c == '+' || c == '?')
+        {
+            min = c == '+' ? 1 : 0;
+            max = c == '?' ? 1 : -1;
+            parser->pos++;
+        }
+        else if (c == '{' && isdigit((unsigned char)parser->pos[1]))
+        {
+            char *after;
+            min = strtol(parser->pos + 1, &after, 10);
+            max = min;
+            if (*after == ',')
+            {
+                after++;
+                max = isdigit((unsigned char)*after) ? strtol(after, &after, 10) : -1;
+            }
+            if (*after != '}' || (max != -1 && max < min) || min > REGEX_MAX_REPEAT || max > REGEX_MAX_REPEAT)
+            {
+                parser->error = "invalid {m,n} repetition";
+                freeRegexNode(node);
+                return NULL;
+            }
+            parser->pos = after + 1;
+        }
+        else
+        {
+            break;
+        }
+
+        struct regexNode *repeat = newRegexNode(REGEX_REPEAT);
+        repeat->left = node;
+        repeat->min = min;
+        repeat->max = max;
+        node = repeat;
+    }
+    return node;
+}
+
+struct regexNode *parseRegexConcat(struct regexParser *parser)
+{
+    struct regexNode *node = NULL;
+
+    while (*parser->pos != '\0' && *parser->pos != '|' && *parser->pos != ')')
+    {
+        struct regexNode *next = parseRegexRepeat(parser);
+        if (next == NULL)
+        {
+            freeRegexNode(node);
+            return NULL;
+        }
+        if (node == NULL)
+        {
+            node = next;
+        }
+        else
+        {
+            struct regexNode *concat = newRegexNode(REGEX_CONCAT);
+            concat->left = node;
+            concat->right = next;
+            node = concat;
+        }
+    }
+    return node != NULL ? node : newRegexNode(REGEX_EMPTY);
+}
+
+struct regexNode *parseRegexAlternation(struct regexParser *parser)
+{
+    struct regexNode *node = parseRegexConcat(parser);
+
+    while (node != NULL && *parser->pos == '|')
+    {
+        parser->pos++;
+        struct regexNode *next = parseRegexConcat(parser);
+        if (next == NULL)
+        {
+            freeRegexNode(node);
+            return NULL;
+        }
+        struct regexNode *alternation = newRegexNode(REGEX_ALTERNATE);
+        alternation->left = node;
+        alternation->right = next;
+        node = alternation;
+    }
+    return node;
+}
+
+int singleCharOf(const struct regexNode *node)
+{
+    int found = -1;
+
+    if (node->type != REGEX_CHARSET)
+    {
+        return -1;
+    }
+    for (int c = 0; c < 256; c++)
+    {
+        if (node->set[c >> 3] & (1 << (c & 7)))
+        {
+            if (found != -1)
+            {
+                return -1;
+            }
+            found = c;
+        }
+    }
+    return found;
+}
+
+// Walks the top-level concatenation left to right, collecting runs of single
+// characters every match must contain; the longest run becomes the prefilter
+void collectRequiredLiteral(const struct regexNode *node, struct regexProgram *prog, char *run, size_t *runLength)
+{
+    int c;
+
+    if (node->type == REGEX_CONCAT)
+    {
+        collectRequiredLiteral(node->left, prog, run, runLength);
+        collectRequiredLiteral(node->right, prog, run, runLength);
+        return;
+    }
+    if (node->type == REGEX_BOL || node->type == REGEX_EOL)
+    {
+        return;
+    }
+
+    c = singleCharOf(node);
+    if (c == -1 && node->type == REGEX_REPEAT && node->min >= 1)
+    {
+        // x+ or x{2,}: x is required, but what follows is not adjacent to the run
+        c = singleCharOf(node->left);
+        if (c != -1 && *runLength < REGEX_MAX_LITERAL)
+        {
+            run[(*runLength)++] = c;
+        }
+        if (*runLength > prog->literalLength)
+        {
+            memcpy(prog->literal, run, *runLength);
+            prog->literalLength = *runLength;
+        }
+        *runLength = 0;
+        if (c != -1 && node->max == node->min)
+        {
+            run[(*runLength)++] = c;
+        }
+        return;
+    }
+    if (c != -1 && *runLength < REGEX_MAX_LITERAL)
+    {
+        run[(*runLength)++] = c;
+        if (*runLength > prog->literalLength)
+        {
+            memcpy(prog->literal, run, *runLength);
+            prog->literalLength = *runLength;
+        }
+        return;
+    }
+    *runLength = 0;
+}
+
+// Past REGEX_MAX_STATES, or when memory runs out, the program is marked
+// too large and state 0 is handed out so the caller can unwind
+int addNfaState(struct regexProgram *prog, int type, int out, int out1)
+{
+    if (prog->tooLarge || prog->stateCount == REGEX_MAX_STATES)
+    {
+        prog->tooLarge = 1;
+        return 0;
+    }
+    if (prog->stateCount == prog->stateCapacity)
+    {
+        int capacity = prog->stateCapacity ? prog->stateCapacity * 2 : 64;
+        struct nfaState *states = realloc(prog->states, capacity * sizeof(struct nfaState));
+        if (states == NULL)
+        {
+            prog->tooLarge = 1;
+            return 0;
+        }
+        prog->states = states;
+        prog->stateCapacity = capacity;
+    }
+    struct nfaState *state = &prog->states[prog->stateCount];
+    memset(state, 0, sizeof(struct nfaState));
+    state->type = type;
+    state->out = out;
+    state->out1 = out1;
+    return prog->stateCount++;
+}
+
+// Compiles node so that it continues into next; returns its entry state
+int compileRegexNode(struct regexProgram *prog, const struct regexNode *node, int next)
+{
+    int state;
+
+    if (prog->tooLarge)
+    {
+        return next;
+    }
+    switch (node->type)
+    {
+    case REGEX_EMPTY:
+        return next;
+    case REGEX_CHARSET:
+        state = addNfaState(prog, NFA_CHARSET, next, -1);
+        if (!prog->tooLarge)
+        {
+            memcpy(prog->states[state].set, node->set, sizeof(node->set));
+        }
+        return state;
+    case REGEX_BOL:
+        return addNfaState(prog, NFA_BOL, next, -1);
+    case REGEX_EOL:
+        return addNfaState(prog, NFA_EOL, next, -1);
+    case REGEX_CONCAT:
+        return compileRegexNode(prog, node->left, compileRegexNode(prog, node->right, next));
+    case REGEX_ALTERNATE:
+    {
+        int left = compileRegexNode(prog, node->left, next);
+        int right = compileRegexNode(prog, node->right, next);
+        return addNfaState(prog, NFA_SPLIT, left, right);
+    }
+    case REGEX_REPEAT:
+    {
+        // Built back to front: the optional (or looping) tail first, then min mandatory copies
+        int entry = next;
+        if (node->max == -1)
+        {
+            int loop = addNfaState(prog, NFA_SPLIT, -1, next);
+            int body = compileRegexNode(prog, node->left, loop);
+            if (prog->tooLarge)
+            {
+                return next;
+            }
+            prog->states[loop].out = body;
+            entry = loop;
+        }
+        else
+        {
+            for (int i = node->min; i < node->max && !prog->tooLarge; i++)
+            {
+                int body = compileRegexNode(prog, node->left, entry);
+                entry = addNfaState(prog, NFA_SPLIT, body, next);
+            }
+        }
+        for (int i = 0; i < node->min && !prog->tooLarge; i++)
+        {
+            entry = compileRegexNode(prog, node->left, entry);
+        }
+        return entry;
+    }
+    }
+    return next;
+}
+
+struct regexProgram *compileRegex(const char *pattern)
+{
+    struct regexParser parser = {pattern, NULL};
+    struct regexNode *tree = parseRegexAlternation(&parser);
+
+    if (tree != NULL && *parser.pos != '\0')
+    {
+        parser.error = "unmatched )";
+        freeRegexNode(tree);
+        tree = NULL;
+    }
+    if (tree == NULL)
+    {
+        fprintf(stderr, "search: invalid regular expression '%s': %s\n", pattern, parser.error);
+        return NULL;
+    }
+
+    struct regexProgram *prog = calloc(1, sizeof(struct regexProgram));
+    if (prog == NULL)
+    {
+        perror("calloc");
+        freeRegexNode(tree);
+        return NULL;
+    }
+
+    int match = addNfaState(prog, NFA_MATCH, -1, -1);
+    prog->start = compileRegexNode(prog, tree, match);
+    if (prog->tooLarge)
+    {
+        fprintf(stderr, "search: invalid regular expression '%s': too large (over %d states)\n", pattern,
+                REGEX_MAX_STATES);
+        freeRegexNode(tree);
+        freeRegexProgram(prog);
+        return NULL;
+    }
+
+    char run[REGEX_MAX_LITERAL];
+    size_t runLength = 0;
+    collectRequiredLiteral(tree, prog, run, &runLength);
+    prog->literal[prog->literalLength] = '\0';
+
+    freeRegexNode(tree);
+    return prog;
+}
+
+void freeRegexProgram(struct regexProgram *prog)
+{
+    if (prog != NULL)
+    {
+        free(prog->states);
+        free(prog);
+    }
+}
+
+void resetLazyDfa(struct lazyDfa *dfa)
+{
+    for (int i = 0; i < dfa->stateCount; i++)
+    {
+        free(dfa->states[i].nfaStates);
+    }
+    dfa->stateCount = 0;
+    memset(dfa->buckets, 0xff, DFA_HASH_SIZE * sizeof(int));
+    dfa->startBol = -1;
+    dfa->startMid = -1;
+}
+
+void initLazyDfa(struct lazyDfa *dfa, const struct regexProgram *prog)
+{
+    memset(dfa, 0, sizeof(struct lazyDfa));
+    dfa->prog = prog;
+    dfa->states = malloc(DFA_MAX_STATES * sizeof(struct dfaState));
+    dfa->buckets = malloc(DFA_HASH_SIZE * sizeof(int));
+    dfa->stack = malloc(prog->stateCount * sizeof(int));
+    dfa->set = malloc(prog->stateCount * sizeof(int));
+    dfa->marks = calloc(prog->stateCount, sizeof(unsigned int));
+    if (dfa->states == NULL || dfa->buckets == NULL || dfa->stack == NULL || dfa->set == NULL || dfa->marks == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    resetLazyDfa(dfa);
+}
+
+void destroyLazyDfa(struct lazyDfa *dfa)
+{
+    if (dfa->prog == NULL)
+    {
+        return;
+    }
+    resetLazyDfa(dfa);
+    free(dfa->states);
+    free(dfa->buckets);
+    free(dfa->stack);
+    free(dfa->set);
+    free(dfa->marks);
+    dfa->prog = NULL;
+}
+
+// Adds state and everything reachable through epsilon moves to dfa->set.
+// ^ is only crossed at the start of a line and $ only at its end.
+void addNfaClosure(struct lazyDfa *dfa, int state, int atBol, int atEol)
+{
+    const struct regexProgram *prog = dfa->prog;
+    int top = 0;
+
+    dfa->stack[top++] = state;
+    while (top > 0)
+    {
+        int s = dfa->stack[--top];
+        if (dfa->marks[s] == dfa->generation)
+        {
+            continue;
+        }
+        dfa->marks[s] = dfa->generation;
+        dfa->set[dfa->setCount++] = s;
+
+        const struct nfaState *nfa = &prog->states[s];
+        if (nfa->type == NFA_SPLIT)
+        {
+            dfa->stack[top++] = nfa->out1;
+            dfa->stack[top++] = nfa->out;
+        }
+        else if ((nfa->type == NFA_BOL && atBol) || (nfa->type == NFA_EOL && atEol))
+        {
+            dfa->stack[top++] = nfa->out;
+        }
+    }
+}
+
+void beginNfaSet(struct lazyDfa *dfa)
+{
+    dfa->setCount = 0;
+    if (++dfa->generation == 0)
+    {
+        memset(dfa->marks, 0, dfa->prog->stateCount * sizeof(unsigned int));
+        dfa->generation = 1;
+    }
+}
+
+// Interns the current dfa->set as a DFA state
+int internDfaState(struct lazyDfa *dfa)
+{
+    qsort(dfa->set, dfa->setCount, sizeof(int), compareInts);
+
+    unsigned int hash = 2166136261u;
+    for (int i = 0; i < dfa->setCount; i++)
+    {
+        hash = (hash ^ (unsigned int)dfa->set[i]) * 16777619u;
+    }
+    int bucket = hash & (DFA_HASH_SIZE - 1);
+    for (int i = dfa->buckets[bucket]; i != -1; i = dfa->states[i].chain)
+    {
+        if (dfa->states[i].count == dfa->setCount &&
+            memcmp(dfa->states[i].nfaStates, dfa->set, dfa->setCount * sizeof(int)) == 0)
+        {
+            return i;
+        }
+    }
+
+    if (dfa->stateCount == DFA_MAX_STATES)
+    {
+        return -1;
+    }
+    struct dfaState *state = &dfa->states[dfa->stateCount];
+    state->nfaStates = malloc((dfa->setCount ? dfa->setCount : 1) * sizeof(int));
+    if (state->nfaStates == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(state->nfaStates, dfa->set, dfa->setCount * sizeof(int));
+    state->count = dfa->setCount;
+    state->isMatch = 0;
+    state->eolMatch = -1;
+    for (int i = 0; i < dfa->setCount; i++)
+    {
+        if (dfa->prog->states[dfa->set[i]].type == NFA_MATCH)
+        {
+            state->isMatch = 1;
+        }
+    }
+    memset(state->next, 0xff, sizeof(state->next));
+    state->chain = dfa->buckets[bucket];
+    dfa->buckets[bucket] = dfa->stateCount;
+    return dfa->stateCount++;
+}
+
+int compareInts(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int dfaStartState(struct lazyDfa *dfa, int atBol)
+{
+    int *start = atBol ? &dfa->startBol : &dfa->startMid;
+
+    if (*start == -1)
+    {
+        beginNfaSet(dfa);
+        addNfaClosure(dfa, dfa->prog->start, atBol, 0);
+        *start = internDfaState(dfa);
+    }
+    return *start;
+}
+
+// Transition of state on byte c. The search is unanchored, so the NFA start
+// state is re-entered at every position.
+int dfaStep(struct lazyDfa *dfa, int state, unsigned char c)
+{
+    int next = dfa->states[state].next[c];
+    if (next != -1)
+    {
+        return next;
+    }
+
+    beginNfaSet(dfa);
+    for (int i = 0; i < dfa->states[state].count; i++)
+    {
+        const struct nfaState *nfa = &dfa->prog->states[dfa->states[state].nfaStates[i]];
+        if (nfa->type == NFA_CHARSET && (nfa->set[c >> 3] & (1 << (c & 7))))
+        {
+            addNfaClosure(dfa, nfa->out, 0, 0);
+        }
+    }
+    addNfaClosure(dfa, dfa->prog->start, 0, 0);
+
+    next = internDfaState(dfa);
+    if (next == -1)
+    {
+        // Cache full: start over, keeping only the state being built
+        int *saved = malloc((dfa->setCount ? dfa->setCount : 1) * sizeof(int));
+        int savedCount = dfa->setCount;
+        if (saved == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(saved, dfa->set, savedCount * sizeof(int));
+        resetLazyDfa(dfa);
+        memcpy(dfa->set, saved, savedCount * sizeof(int));
+        dfa->setCount = savedCount;
+        free(saved);
+        return internDfaState(dfa);
+    }
+    dfa->states[state].next[c] = next;
+    return next;
+}
+
+// Whether state matches when the line ends right here ($ satisfied)
+int dfaEolMatch(struct lazyDfa *dfa, int state)
+{
+    struct dfaState *s = &dfa->states[state];
+
+    if (s->eolMatch == -1)
+    {
+        int count = s->count;
+        int *nfaStates = s->nfaStates;
+
+        beginNfaSet(dfa);
+        for (int i = 0; i < count; i++)
+        {
+            addNfaClosure(dfa, nfaStates[i], 0, 1);
+        }
+        s->eolMatch = 0;
+        for (int i = 0; i < dfa->setCount; i++)
+        {
+            if (dfa->prog->states[dfa->set[i]].type == NFA_MATCH)
+            {
+                s->eolMatch = 1;
+            }
+        }
+    }
+    return s->eolMatch;
+}
+
+// Start of the first line in [text, end) that the regex matches
+const char *dfaFindLine(struct lazyDfa *dfa, const char *text, const char *end)
+{
+    const char *lineStart = text;
+    int state = dfaStartState(dfa, 1);
+
+    for (const char *p = text; p < end; p++)
+    {
+        if (dfa->states[state].isMatch)
+        {
+            return lineStart;
+        }
+        if (*p == '\n')
+        {
+            if (dfaEolMatch(dfa, state))
+            {
+                return lineStart;
+            }
+            lineStart = p + 1;
+            state = dfaStartState(dfa, 1);
+            continue;
+        }
+        state = dfaStep(dfa, state, *p);
+    }
+    // After a final newline there is no further line, not an empty one
+    if (lineStart < end && (dfa->states[state].isMatch || dfaEolMatch(dfa, state)))
+    {
+        return lineStart;
+    }
+    return NULL;
+}
+
+// Uses the required literal to jump to candidate lines and runs the DFA only on those
+const char *scanRegex(struct searchWorker *worker, const char *pos, const char *end)
+{
+    const struct regexProgram *prog = worker->ctx->regex;
+
+    if (worker->dfa.prog == NULL)
+    {
+        initLazyDfa(&worker->dfa, prog);
+    }
+    if (prog->literalLength == 0)
+    {
+        return dfaFindLine(&worker->dfa, pos, end);
+    }
+
+    while (pos < end)
+    {
+        const char *candidate = scanLiteral(pos, end - pos, prog->literal, prog->literalLength);
+        if (candidate == NULL)
+        {
+            return NULL;
+        }
+        const char *lineStart = memrchr(pos, '\n', candidate - pos);
+        lineStart = lineStart == NULL ? pos : lineStart + 1;
+        const char *lineEnd = memchr(candidate, '\n', end - candidate);
+        if (lineEnd == NULL)
+        {
+            lineEnd = end;
+        }
+        if (dfaFindLine(&worker->dfa, lineStart, lineEnd) != NULL)
+        {
+            return lineStart;
+        }
+        pos = lineEnd + 1;
+    }
+    return NULL;
+}
+
+// Maps large files and reads small ones in one go into the worker's buffer.
+// Returns the file contents, or NULL for empty or unreadable files; *mapped tells
+// the caller whether to munmap() it.
+const char *loadSearchFile(struct searchWorker *worker, int fd, off_t maxSize, size_t *len, int *mapped)
+{
+    struct stat st;
+
+    *mapped = 0;
+    if (fstat(fd, &st) == -1)
+    {
+        perror("fstat");
+        return NULL;
+    }
+    *len = st.st_size;
+    if (*len == 0 || (maxSize > 0 && st.st_size > maxSize))
+    {
+        return NULL;
+    }
+
+    if (*len >= SCAN_MMAP_THRESHOLD)
+    {
+        void *map = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            madvise(map, *len, MADV_SEQUENTIAL);
+            *mapped = 1;
+            return map;
+        }
+    }
+
+    if (worker->bufferSize < *len)
+    {
+        char *grown = realloc(worker->buffer, *len);
+        if (grown == NULL)
+        {
+            perror("realloc");
+            return NULL;
+        }
+        worker->buffer = grown;
+        worker->bufferSize = *len;
+    }
+
+    size_t total = 0;
+    while (total < *len)
+    {
+        ssize_t n = read(fd, worker->buffer + total, *len - total);
+        if (n == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n == -1)
+        {
+            perror("read");
+            return NULL;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        total += n;
+    }
+    *len = total;
+    return total ? worker->buffer : NULL;
+}
+
+// Result cache: one file per query (patterns, options and root) holding the
+// match list of every file the query visited, keyed by (dev, inode, size,
+// mtime). A file whose key is unchanged is answered from the cache without
+// being opened. The directory is kept under a size bound by evicting the
+// least recently used query files, which are rewritten or touched on use.
+uint64_t hashCacheKey(const char *key, size_t length)
+{
+    uint64_t hash = 1469598103934665603ULL;
+
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+size_t hashFileIdentity(uint64_t dev, uint64_t ino)
+{
+    uint64_t hash = (dev * 0x9e3779b97f4a7c15ULL) ^ (ino * 0xc2b2ae3d27d4eb4fULL);
+    return (size_t)(hash ^ (hash >> 29));
+}
+
+// Everything that changes which files are searched or what is reported in them
+int buildCacheKey(struct searchCache *cache, const struct searchOptions *options, const char *root)
+{
+    struct resultSink key;
+    char number[64];
+
+    memset(&key, 0, sizeof(key));
+    sinkAppend(&key, root, strlen(root) + 1);
+    int n = snprintf(number, sizeof(number), "%d %d %d %lld %d %zu", options->recursive, options->useRegex,
+                     options->noIgnore, (long long)options->maxFileSize, options->outputMode, options->maxCount);
+    sinkAppend(&key, number, n + 1);
+    for (size_t i = 0; i <= options->fileFilter->mask; i++)
+    {
+        if (options->fileFilter->slots[i] != NULL)
+        {
+            sinkAppend(&key, options->fileFilter->slots[i], strlen(options->fileFilter->slots[i]) + 1);
+        }
+    }
+    for (int i = 0; i < options->patternCount; i++)
+    {
+        sinkAppend(&key, options->patterns[i], strlen(options->patterns[i]) + 1);
+    }
+    if (key.failed)
+    {
+        // A truncated key could name another query's entries
+        free(key.data);
+        return -1;
+    }
+    cache->key = key.data;
+    cache->keyLength = key.length;
+    return 0;
+}
+
+// $MYSHELL_CACHE_DIR, else $XDG_CACHE_HOME/myshell, else ~/.cache/myshell
+int findCacheDirectory(char *dir, size_t size)
+{
+    const char *env = getenv("MYSHELL_CACHE_DIR");
+
+    if (env != NULL && env[0] != '\0')
+    {
+        snprintf(dir, size, "%s", env);
+    }
+    else if ((env = getenv("XDG_CACHE_HOME")) != NULL && env[0] != '\0')
+    {
+        snprintf(dir, size, "%s/myshell", env);
+    }
+    else if ((env = getenv("HOME")) != NULL && env[0] != '\0')
+    {
+        snprintf(dir, size, "%s/.cache", env);
+        mkdir(dir, 0700);
+        snprintf(dir, size, "%s/.cache/myshell", env);
+    }
+    else
+    {
+        return -1;
+    }
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int openSearchCache(struct searchCache *cache, const struct searchOptions *options, const char *root)
+{
+    memset(cache, 0, sizeof(struct searchCache));
+    if (findCacheDirectory(cache->dir, sizeof(cache->dir)) == -1)
+    {
+        return -1;
+    }
+    if (buildCacheKey(cache, options, root) == -1)
+    {
+        return -1;
+    }
+    snprintf(cache->path, sizeof(cache->path), "%s/%016llx", cache->dir,
+             (unsigned long long)hashCacheKey(cache->key, cache->keyLength));
+    atomic_init(&cache->misses, 0);
+
+    int fd = open(cache->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1)
+    {
+        return 0;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct cacheFileHeader))
+    {
+        close(fd);
+        return 0;
+    }
+    cache->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (cache->map == MAP_FAILED)
+    {
+        cache->map = NULL;
+        return 0;
+    }
+    cache->mapLength = st.st_size;
+
+    // A stale, foreign (hash collision) or damaged file is treated as empty
+    struct cacheFileHeader header;
+    memcpy(&header, cache->map, sizeof(header));
+    size_t offset = sizeof(header) + header.keyLength;
+    if (memcmp(header.magic, SEARCH_CACHE_MAGIC, 8) != 0 || header.keyLength != cache->keyLength ||
+        offset > cache->mapLength || memcmp(cache->map + sizeof(header), cache->key, cache->keyLength) != 0 ||
+        header.entryCount > (cache->mapLength - offset) / sizeof(struct cacheEntryHeader))
+    {
+        closeSearchCache(cache);
+        return 0;
+    }
+
+    size_t size = 16;
+    while (size < header.entryCount * 2)
+    {
+        size *= 2;
+    }
+    cache->slots = calloc(size, sizeof(char *));
+    if (cache->slots == NULL)
+    {
+        perror("calloc");
+        closeSearchCache(cache);
+        return 0;
+    }
+    cache->mask = size - 1;
+    for (uint64_t i = 0; i < header.entryCount; i++)
+    {
+        struct cacheEntryHeader entry;
+        if (offset + sizeof(entry) > cache->mapLength)
+        {
+            break;
+        }
+        memcpy(&entry, cache->map + offset, sizeof(entry));
+        if (entry.dataLength > cache->mapLength - offset - sizeof(entry))
+        {
+            break;
+        }
+        size_t slot = hashFileIdentity(entry.dev, entry.ino) & cache->mask;
+        while (cache->slots[slot] != NULL)
+        {
+            slot = (slot + 1) & cache->mask;
+        }
+        cache->slots[slot] = cache->map + offset;
+        cache->entryCount++;
+        offset += sizeof(entry) + entry.dataLength;
+    }
+    return 0;
+}
+
+void closeSearchCache(struct searchCache *cache)
+{
+    if (cache->map != NULL)
+    {
+        munmap(cache->map, cache->mapLength);
+        cache->map = NULL;
+    }
+    free(cache->slots);
+    cache->slots = NULL;
+    cache->entryCount = 0;
+}
+
+const char *lookupSearchCache(const struct searchCache *cache, const struct stat *st)
+{
+    if (cache->slots == NULL)
+    {
+        return NULL;
+    }
+    for (size_t slot = hashFileIdentity(st->st_dev, st->st_ino) & cache->mask; cache->slots[slot] != NULL;
+         slot = (slot + 1) & cache->mask)
+    {
+        struct cacheEntryHeader entry;
+        memcpy(&entry, cache->slots[slot], sizeof(entry));
+        if (entry.dev == (uint64_t)st->st_dev && entry.ino == (uint64_t)st->st_ino)
+        {
+            if (entry.size != st->st_size || entry.mtimeSec != st->st_mtim.tv_sec ||
+                entry.mtimeNsec != st->st_mtim.tv_nsec)
+            {
+                return NULL;
+            }
+            return cache->slots[slot];
+        }
+    }
+    return NULL;
+}
+
+// Replays a cached match list into the sink and carries the entry over into
+// the cache file this search writes
+void replayCachedFile(struct searchWorker *worker, const char *cached, const char *filePath)
+{
+    struct searchContext *ctx = worker->ctx;
+    struct cacheEntryHeader entry;
+
+    memcpy(&entry, cached, sizeof(entry));
+    const char *data = cached + sizeof(entry);
+    const char *end = data + entry.dataLength;
+    size_t matchCount = 0;
+    int wanted = 1;
+    while (wanted && matchCount < entry.matchCount && data + sizeof(struct cacheMatchHeader) <= end)
+    {
+        struct cacheMatchHeader match;
+        memcpy(&match, data, sizeof(match));
+        data += sizeof(match);
+        if (match.length > (size_t)(end - data))
+        {
+            break;
+        }
+        int pattern = -1;
+        if (ctx->automaton != NULL && match.pattern >= 0 && match.pattern < ctx->options->patternCount)
+        {
+            pattern = match.pattern;
+        }
+        wanted = reportMatch(worker, ++matchCount, match.lineNumber, filePath, pattern, data, match.length);
+        data += match.length;
+    }
+    finishFileOutput(worker, filePath, matchCount);
+
+    sinkAppend(&worker->cacheOut, cached, sizeof(entry) + entry.dataLength);
+    worker->cacheEntries++;
+}
+
+void beginCacheEntry(struct searchWorker *worker, const struct stat *st)
+{
+    struct cacheEntryHeader entry;
+
+    memset(&entry, 0, sizeof(entry));
+    entry.dev = st->st_dev;
+    entry.ino = st->st_ino;
+    entry.size = st->st_size;
+    entry.mtimeSec = st->st_mtim.tv_sec;
+    entry.mtimeNsec = st->st_mtim.tv_nsec;
+    worker->cacheEntry = worker->cacheOut.length;
+    sinkAppend(&worker->cacheOut, (const char *)&entry, sizeof(entry));
+}
+
+void recordCachedMatch(struct searchWorker *worker, size_t lineNumber, int pattern, const char *line, size_t lineLength)
+{
+    struct cacheMatchHeader match = {lineNumber, pattern, lineLength};
+
+    sinkAppend(&worker->cacheOut, (const char *)&match, sizeof(match));
+    sinkAppend(&worker->cacheOut, line, lineLength);
+    if (!worker->cacheOut.failed)
+    {
+        ((struct cacheEntryHeader *)(worker->cacheOut.data + worker->cacheEntry))->matchCount++;
+    }
+}
+
+void endCacheEntry(struct searchWorker *worker)
+{
+    if (!worker->cacheOut.failed)
+    {
+        struct cacheEntryHeader *entry = (struct cacheEntryHeader *)(worker->cacheOut.data + worker->cacheEntry);
+        entry->dataLength = worker->cacheOut.length - worker->cacheEntry - sizeof(struct cacheEntryHeader);
+    }
+    worker->cacheEntry = SIZE_MAX;
+    worker->cacheEntries++;
+    atomic_fetch_add(&worker->ctx->cache->misses, 1);
+}
+
+struct cacheFileInfo
+{
+    char name[32];
+    off_t size;
+    time_t mtime;
+};
+
+int compareCacheFiles(const void *a, const void *b)
+{
+    const struct cacheFileInfo *x = a;
+    const struct cacheFileInfo *y = b;
+
+    return (x->mtime < y->mtime) - (x->mtime > y->mtime);
+}
+
+// Deletes the least recently used query files until the directory fits the
+// bound ($MYSHELL_CACHE_SIZE, 64M by default); the newest is always kept
+void evictSearchCache(const char *dir)
+{
+    const char *env = getenv("MYSHELL_CACHE_SIZE");
+    off_t limit = env != NULL ? parseSize(env) : SEARCH_CACHE_DEFAULT_SIZE;
+    struct cacheFileInfo *files = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    struct dirent *entry;
+    DIR *d = opendir(dir);
+
+    if (d == NULL || limit <= 0)
+    {
+        if (d != NULL)
+        {
+            closedir(d);
+        }
+        return;
+    }
+    while ((entry = readdir(d)) != NULL)
+    {
+        struct stat st;
+        if (strlen(entry->d_name) != 16 || strspn(entry->d_name, "0123456789abcdef") != 16 ||
+            fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1 || !S_ISREG(st.st_mode))
+        {
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 32;
+            files = realloc(files, capacity * sizeof(struct cacheFileInfo));
+            if (files == NULL)
+            {
+                perror("realloc");
+                closedir(d);
+                return;
+            }
+        }
+        snprintf(files[count].name, sizeof(files[count].name), "%s", entry->d_name);
+        files[count].size = st.st_size;
+        files[count].mtime = st.st_mtime;
+        count++;
+    }
+
+    qsort(files, count, sizeof(struct cacheFileInfo), compareCacheFiles);
+    off_t total = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        total += files[i].size;
+        if (i > 0 && total > limit)
+        {
+            unlinkat(dirfd(d), files[i].name, 0);
+        }
+    }
+    closedir(d);
+    free(files);
+}
+
+// Writes the entries the workers collected as the query's new cache file, or
+// only marks it used when nothing changed
+void saveSearchCache(struct searchContext *ctx)
+{
+    struct searchCache *cache = ctx->cache;
+    struct cacheFileHeader header;
+    uint64_t entryCount = 0;
+    char tempPath[sizeof(cache->path) + 32]; // cache->path, ".tmp." and a pid
+
+    for (int i = 0; i < ctx->workerCount; i++)
+    {
+        if (ctx->workers[i].cacheOut.failed)
+        {
+            // Some entry is incomplete; the old file stays
+            return;
+        }
+        entryCount += ctx->workers[i].cacheEntries;
+    }
+    if (atomic_load(&cache->misses) == 0 && entryCount == cache->entryCount)
+    {
+        utimensat(AT_FDCWD, cache->path, NULL, 0);
+        return;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SEARCH_CACHE_MAGIC, 8);
+    header.keyLength = cache->keyLength;
+    header.entryCount = entryCount;
+
+    if (snprintf(tempPath, sizeof(tempPath), "%s.tmp.%d", cache->path, getpid()) >= (int)sizeof(tempPath))
+    {
+        return;
+    }
+    int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        return;
+    }
+    struct iovec *iov = malloc((ctx->workerCount + 2) * sizeof(struct iovec));
+    if (iov == NULL)
+    {
+        perror("malloc");
+        close(fd);
+        unlink(tempPath);
+        return;
+    }
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = cache->key;
+    iov[1].iov_len = cache->keyLength;
+    for (int i = 0; i < ctx->workerCount; i++)
+    {
+        iov[i + 2].iov_base = ctx->workers[i].cacheOut.data;
+        iov[i + 2].iov_len = ctx->workers[i].cacheOut.length;
+    }
+    int failed = writeAll(fd, iov, ctx->workerCount + 2) == -1;
+    free(iov);
+    if (close(fd) == -1 || failed || rename(tempPath, cache->path) == -1)
+    {
+        unlink(tempPath);
+        return;
+    }
+    evictSearchCache(cache->dir);
+}
+
+void searchFilesKaragulHelper(struct searchWorker *worker, int fd, const char *filePath)
+{
+    size_t len;
+    int mapped;
+
+    const char *text = loadSearchFile(worker, fd, worker->ctx->options->maxFileSize, &len, &mapped);
+    close(fd);
+    if (text == NULL)
+    {
+        return;
+    }
+    searchFileText(worker, text, len, filePath);
+    if (mapped)
+    {
+        munmap((void *)text, len);
+    }
+}
+
+// Scans a file's contents once they are in memory, however they got there
+void searchFileText(struct searchWorker *worker, const char *text, size_t len, const char *filePath)
+{
+    struct searchContext *ctx = worker->ctx;
+
+    // A NUL byte in the first block means binary content
+    if (memchr(text, '\0', len < BINARY_CHECK_SIZE ? len : BINARY_CHECK_SIZE) != NULL)
+    {
+        return;
+    }
+
+    const char *end = text + len;
+    const char *pos = text; // always the start of a line
+    size_t lineNumber = 1;
+    size_t matchCount = 0;
+    int wanted = 1;
+    int numbered = ctx->options->outputMode == OUTPUT_LINES;
+
+    while (wanted && pos < end)
+    {
+        int pattern;
+        const char *match = findNextMatch(worker, pos, end, &pattern);
+        if (match == NULL)
+        {
+            break;
+        }
+
+        // Line numbers are only worked out up to the lines that actually match
+        const char *lineStart = memrchr(pos, '\n', match - pos);
+        lineStart = lineStart == NULL ? pos : lineStart + 1;
+        if (numbered)
+        {
+            // -l, -c and -q never print a line number
+            lineNumber += countNewlines(pos, lineStart - pos);
+        }
+
+        const char *lineEnd = memchr(match, '\n', end - match);
+        if (lineEnd == NULL)
+        {
+            lineEnd = end;
+        }
+
+        if (ctx->automaton == NULL)
+        {
+            pattern = -1;
+        }
+        if (worker->cacheEntry != SIZE_MAX)
+        {
+            recordCachedMatch(worker, lineNumber, pattern, lineStart, lineEnd - lineStart);
+        }
+        wanted = reportMatch(worker, ++matchCount, lineNumber, filePath, pattern, lineStart, lineEnd - lineStart);
+
+        lineNumber++;
+        pos = lineEnd + 1;
+    }
+
+    finishFileOutput(worker, filePath, matchCount);
+}
+
+void concatenatePaths(const char *path1, const char *path2, char *result)
+{
+    strcpy(result, path1);
+    strcat(result, "/");
+    strcat(result, path2);
+}
+
+// File types: named groups of extensions. A search compiles the enabled groups
+// into an open-addressed table keyed by the text after the last '.', so the
+// per-entry filter is one lookup however many types are enabled.
+void addFileTypeExtensions(const char *name, const char *extensions)
+{
+    struct fileType *type = NULL;
+
+    for (int i = 0; i < fileTypeCount; i++)
+    {
+        if (strcmp(fileTypes[i].name, name) == 0)
+        {
+            type = &fileTypes[i];
+            break;
+        }
+    }
+    if (type == NULL)
+    {
+        if (fileTypeCount == fileTypeCapacity)
+        {
+            fileTypeCapacity = fileTypeCapacity ? fileTypeCapacity * 2 : 16;
+            fileTypes = realloc(fileTypes, fileTypeCapacity * sizeof(struct fileType));
+            if (fileTypes == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        type = &fileTypes[fileTypeCount++];
+        memset(type, 0, sizeof(struct fileType));
+        type->name = strdup(name);
+    }
+
+    char *list = strdup(extensions);
+    char *savePtr;
+    for (char *ext = strtok_r(list, ",", &savePtr); ext != NULL; ext = strtok_r(NULL, ",", &savePtr))
+    {
+        // Accept "cpp", ".cpp" and "*.cpp"
+        if (ext[0] == '*')
+        {
+            ext++;
+        }
+        if (ext[0] == '.')
+        {
+            ext++;
+        }
+        if (ext[0] == '\0')
+        {
+            continue;
+        }
+        if (type->extensionCount == type->extensionCapacity)
+        {
+            type->extensionCapacity = type->extensionCapacity ? type->extensionCapacity * 2 : 8;
+            type->extensions = realloc(type->extensions, type->extensionCapacity * sizeof(char *));
+            if (type->extensions == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+        type->extensions[type->extensionCount++] = strdup(ext);
+    }
+    free(list);
+}
+
+struct fileType *findFileType(const char *name)
+{
+    for (int i = 0; i < fileTypeCount; i++)
+    {
+        if (strcmp(fileTypes[i].name, name) == 0)
+        {
+            return &fileTypes[i];
+        }
+    }
+    return NULL;
+}
+
+void addSuffix(struct suffixTable *table, const char *ext)
+{
+    size_t slot = hashString(ext) & table->mask;
+
+    while (table->slots[slot] != NULL)
+    {
+        if (strcmp(table->slots[slot], ext) == 0)
+        {
+            return;
+        }
+        slot = (slot + 1) & table->mask;
+    }
+    table->slots[slot] = ext;
+}
+
+// types is NULL for every registered type
+int compileSuffixTable(struct suffixTable *table, struct fileType **types, int typeCount)
+{
+    size_t total = 0;
+    size_t size = 16;
+
+    if (types == NULL)
+    {
+        typeCount = fileTypeCount;
+    }
+    for (int i = 0; i < typeCount; i++)
+    {
+        total += (types ? types[i] : &fileTypes[i])->extensionCount;
+    }
+    while (size < total * 2)
+    {
+        size *= 2;
+    }
+
+    table->slots = calloc(size, sizeof(char *));
+    if (table->slots == NULL)
+    {
+        perror("calloc");
+        return -1;
+    }
+    table->mask = size - 1;
+    for (int i = 0; i < typeCount; i++)
+    {
+        struct fileType *type = types ? types[i] : &fileTypes[i];
+        for (int j = 0; j < type->extensionCount; j++)
+        {
+            addSuffix(table, type->extensions[j]);
+        }
+    }
+    return 0;
+}
+
+void freeSuffixTable(struct suffixTable *table)
+{
+    free(table->slots);
+    table->slots = NULL;
+}
+
+int matchesFileType(const struct suffixTable *table, const char *name)
+{
+    const char *dot = strrchr(name, '.');
+
+    if (dot == NULL || dot == name || dot[1] == '\0')
+    {
+        return 0;
+    }
+    for (size_t slot = hashString(dot + 1) & table->mask; table->slots[slot] != NULL; slot = (slot + 1) & table->mask)
+    {
+        if (strcmp(table->slots[slot], dot + 1) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void initFileTypes()
+{
+    addFileTypeExtensions("c", "c,h,C,H");
+    addFileTypeExtensions("cpp", "cpp,cc,cxx,c++,C,hpp,hh,hxx,h++,h,H,inl,ipp,tpp");
+    addFileTypeExtensions("asm", "s,S,asm");
+    addFileTypeExtensions("go", "go");
+    addFileTypeExtensions("java", "java");
+    addFileTypeExtensions("js", "js,mjs,cjs");
+    addFileTypeExtensions("py", "py");
+    addFileTypeExtensions("rust", "rs");
+    addFileTypeExtensions("sh", "sh,bash");
+
+    struct fileType *defaultType = findFileType("c");
+    compileSuffixTable(&defaultFilter, &defaultType, 1);
+}
+
+// Directory iterator: pulls entries straight from getdents64() in large batches
+// and only stats an entry when the filesystem does not report its type.
+void initDirIterator(struct dirIterator *it, int fd, char *buffer, size_t size)
+{
+    it->fd = fd;
+    it->buffer = buffer;
+    it->size = size;
+    it->used = 0;
+    it->offset = 0;
+}
+
+// Returns 1 with *name/*type filled in, 0 at the end of the directory and -1 on error.
+// "." and ".." are skipped; *type is DT_UNKNOWN only if fstatat() failed as well.
+int nextDirEntry(struct dirIterator *it, const char **name, unsigned char *type)
+{
+    while (1)
+    {
+        if (it->offset >= it->used)
+        {
+            long n = syscall(SYS_getdents64, it->fd, it->buffer, it->size);
+            if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return n == 0 ? 0 : -1;
+            }
+            it->used = n;
+            it->offset = 0;
+        }
+
+        struct linuxDirent64 *entry = (struct linuxDirent64 *)(it->buffer + it->offset);
+        it->offset += entry->d_reclen;
+
+        if (entry->d_name[0] == '.' && (entry->d_name[1] == '\0' || (entry->d_name[1] == '.' && entry->d_name[2] == '\0')))
+        {
+            continue;
+        }
+
+        *name = entry->d_name;
+        *type = entry->d_type;
+        if (*type == DT_UNKNOWN)
+        {
+            struct stat st;
+            if (fstatat(it->fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+            {
+                *type = S_ISREG(st.st_mode) ? DT_REG : S_ISDIR(st.st_mode) ? DT_DIR
+                                                 : S_ISLNK(st.st_mode) ? DT_LNK
+                                                                       : DT_UNKNOWN;
+            }
+        }
+        return 1;
+    }
+}
+
+// Ignore files: the .gitignore and .ignore of a directory are compiled into a
+// scope that its subdirectories inherit. Rules follow gitignore: blank lines and
+// # comments are skipped, ! re-includes, a trailing / matches directories only,
+// a pattern containing / is anchored to the scope's directory, * and ? stop at /,
+// ** crosses directories. Deeper scopes and later rules win.
+int globMatch(const char *p, const char *t)
+{
+    while (*p != '\0')
+    {
+        if (p[0] == '*' && p[1] == '*')
+        {
+            p += 2;
+            if (*p == '\0')
+            {
+                return 1;
+            }
+            if (*p == '/')
+            {
+                // **/ matches zero or more whole directories
+                p++;
+                while (1)
+                {
+                    if (globMatch(p, t))
+                    {
+                        return 1;
+                    }
+                    t = strchr(t, '/');
+                    if (t == NULL)
+                    {
+                        return 0;
+                    }
+                    t++;
+                }
+            }
+            while (1)
+            {
+                if (globMatch(p, t))
+                {
+                    return 1;
+                }
+                if (*t == '\0')
+                {
+                    return 0;
+                }
+                t++;
+            }
+        }
+        if (*p == '*')
+        {
+            p++;
+            while (1)
+            {
+                if (globMatch(p, t))
+                {
+                    return 1;
+                }
+                if (*t == '\0' || *t == '/')
+                {
+                    return 0;
+                }
+                t++;
+            }
+        }
+        if (*t == '\0')
+        {
+            return 0;
+        }
+        if (*p == '?')
+        {
+            if (*t == '/')
+            {
+                return 0;
+            }
+            p++;
+            t++;
+            continue;
+        }
+        if (*p == '[')
+        {
+            const char *q = p + 1;
+            int negate = (*q == '!' || *q == '^');
+            int matched = 0;
+
+            if (negate)
+            {
+                q++;
+            }
+            const char *first = q;
+            while (*q != '\0' && (*q != ']' || q == first))
+            {
+                if (q[1] == '-' && q[2] != ']' && q[2] != '\0')
+                {
+                    matched |= (unsigned char)*t >= (unsigned char)q[0] && (unsigned char)*t <= (unsigned char)q[2];
+                    q += 3;
+                }
+                else
+                {
+                    matched |= *q == *t;
+                    q++;
+                }
+            }
+            if (*q == ']')
+            {
+                if (matched == negate || *t == '/')
+                {
+                    return 0;
+                }
+                p = q + 1;
+                t++;
+                continue;
+            }
+            // No closing ]: a literal [
+        }
+        if (*p == '\\' && p[1] != '\0')
+        {
+            p++;
+        }
+        if (*p != *t)
+        {
+            return 0;
+        }
+        p++;
+        t++;
+    }
+    return *t == '\0';
+}
+
+void addIgnoreRule(struct ignoreScope *scope, char *line)
+{
+    size_t length = strlen(line);
+    struct ignoreRule rule;
+
+    while (length > 0 && (line[length - 1] == ' ' || line[length - 1] == '\r') && (length < 2 || line[length - 2] != '\\'))
+    {
+        line[--length] = '\0';
+    }
+    if (length == 0 || line[0] == '#')
+    {
+        return;
+    }
+
+    memset(&rule, 0, sizeof(rule));
+    if (line[0] == '!')
+    {
+        rule.negate = 1;
+        line++;
+        length--;
+    }
+    else if (line[0] == '\\' && (line[1] == '!' || line[1] == '#'))
+    {
+        line++;
+        length--;
+    }
+    if (length > 0 && line[length - 1] == '/')
+    {
+        rule.dirOnly = 1;
+        line[--length] = '\0';
+    }
+    if (line[0] == '/')
+    {
+        rule.anchored = 1;
+        line++;
+        length--;
+    }
+    if (length == 0)
+    {
+        return;
+    }
+    if (strchr(line, '/') != NULL)
+    {
+        rule.anchored = 1;
+    }
+
+    // Most rules are a plain name or *.ext; those skip the glob matcher
+    if (!rule.anchored && strpbrk(line, "*?[\\") == NULL)
+    {
+        rule.kind = IGNORE_EXACT;
+    }
+    else if (!rule.anchored && line[0] == '*' && strpbrk(line + 1, "*?[\\") == NULL)
+    {
+        rule.kind = IGNORE_SUFFIX;
+        line++;
+        length--;
+    }
+    else
+    {
+        rule.kind = IGNORE_GLOB;
+    }
+    rule.pattern = strdup(line);
+    rule.length = length;
+
+    if (scope->ruleCount == scope->ruleCapacity)
+    {
+        scope->ruleCapacity = scope->ruleCapacity ? scope->ruleCapacity * 2 : 16;
+        scope->rules = realloc(scope->rules, scope->ruleCapacity * sizeof(struct ignoreRule));
+        if (scope->rules == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    scope->rules[scope->ruleCount++] = rule;
+}
+
+int readIgnoreFile(struct ignoreScope *scope, int dirFd, const char *fileName)
+{
+    int fd = openat(dirFd, fileName, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return 0;
+    }
+    FILE *file = fdopen(fd, "r");
+    if (file == NULL)
+    {
+        close(fd);
+        return 0;
+    }
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t length;
+    int before = scope->ruleCount;
+    while ((length = getline(&line, &size, file)) != -1)
+    {
+        if (length > 0 && line[length - 1] == '\n')
+        {
+            line[length - 1] = '\0';
+        }
+        addIgnoreRule(scope, line);
+    }
+    free(line);
+    fclose(file);
+    return scope->ruleCount > before;
+}
+
+// Returns the scope the entries of dir are judged by: a new one when dir has
+// ignore files of its own, otherwise the inherited one (retained either way)
+struct ignoreScope *loadIgnoreScope(struct ignoreScope *inherited, int dirFd, const char *path)
+{
+    struct ignoreScope *scope = calloc(1, sizeof(struct ignoreScope));
+
+    if (scope == NULL)
+    {
+        perror("calloc");
+        return retainIgnoreScope(inherited);
+    }
+    readIgnoreFile(scope, dirFd, ".gitignore");
+    readIgnoreFile(scope, dirFd, ".ignore");
+    if (scope->ruleCount == 0)
+    {
+        free(scope->rules);
+        free(scope);
+        return retainIgnoreScope(inherited);
+    }
+    scope->parent = retainIgnoreScope(inherited);
+    scope->path = strdup(path);
+    scope->pathLength = strlen(path);
+    atomic_init(&scope->refs, 1);
+    return scope;
+}
+
+struct ignoreScope *retainIgnoreScope(struct ignoreScope *scope)
+{
+    if (scope != NULL)
+    {
+        atomic_fetch_add(&scope->refs, 1);
+    }
+    return scope;
+}
+
+void releaseIgnoreScope(struct ignoreScope *scope)
+{
+    while (scope != NULL && atomic_fetch_sub(&scope->refs, 1) == 1)
+    {
+        struct ignoreScope *parent = scope->parent;
+        for (int i = 0; i < scope->ruleCount; i++)
+        {
+            free(scope->rules[i].pattern);
+        }
+        free(scope->rules);
+        free(scope->path);
+        free(scope);
+        scope = parent;
+    }
+}
+
+// path is the entry's full path, name its last component
+int isIgnored(const struct ignoreScope *scope, const char *path, const char *name, int isDir)
+{
+    size_t nameLength = strlen(name);
+
+    for (; scope != NULL; scope = scope->parent)
+    {
+        const char *relative = path + scope->pathLength + 1;
+
+        for (int i = scope->ruleCount - 1; i >= 0; i--)
+        {
+            const struct ignoreRule *rule = &scope->rules[i];
+            int matched;
+
+            if (rule->dirOnly && !isDir)
+            {
+                continue;
+            }
+            switch (rule->kind)
+            {
+            case IGNORE_EXACT:
+                matched = nameLength == rule->length && memcmp(name, rule->pattern, nameLength) == 0;
+                break;
+            case IGNORE_SUFFIX:
+                matched = nameLength >= rule->length && memcmp(name + nameLength - rule->length, rule->pattern, rule->length) == 0;
+                break;
+            default:
+                matched = globMatch(rule->pattern, rule->anchored ? relative : name);
+                break;
+            }
+            if (matched)
+            {
+                return !rule->negate;
+            }
+        }
+    }
+    return 0;
+}
+
+// An open directory shared by the tasks of its subdirectories, which openat() relative to it
+struct searchDir *retainSearchDir(struct searchDir *dir)
+{
+    atomic_fetch_add(&dir->refs, 1);
+    return dir;
+}
+
+void releaseSearchDir(struct searchDir *dir)
+{
+    if (dir != NULL && atomic_fetch_sub(&dir->refs, 1) == 1)
+    {
+        close(dir->fd);
+        releaseIgnoreScope(dir->scope);
+        free(dir->path);
+        free(dir);
+    }
+}
+
+void pushSearchTask(struct taskDeque *deque, struct searchTask *task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail == deque->capacity)
+    {
+        // Slide the live range down before growing
+        int live = deque->tail - deque->head;
+        if (deque->head > 0 && live < deque->capacity / 2)
+        {
+            memmove(deque->items, deque->items + deque->head, live * sizeof(struct searchTask *));
+        }
+        else
+        {
+            deque->capacity = deque->capacity ? deque->capacity * 2 : 64;
+            deque->items = realloc(deque->items, deque->capacity * sizeof(struct searchTask *));
+            if (deque->items == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            memmove(deque->items, deque->items + deque->head, live * sizeof(struct searchTask *));
+        }
+        deque->head = 0;
+        deque->tail = live;
+    }
+    deque->items[deque->tail++] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+// The owner pops its newest task (depth first, few open parents) ...
+struct searchTask *popSearchTask(struct taskDeque *deque)
+{
+    struct searchTask *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+    {
+        task = deque->items[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+// ... while thieves take the oldest, which tends to be the biggest remaining subtree
+struct searchTask *stealSearchTask(struct taskDeque *deque)
+{
+    struct searchTask *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->tail > deque->head)
+    {
+        task = deque->items[deque->head++];
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+void scheduleSearchTask(struct searchWorker *worker, struct searchDir *parent, const char *name, const char *path)
+{
+    struct searchContext *ctx = worker->ctx;
+    struct searchTask *task = malloc(sizeof(struct searchTask));
+
+    if (task == NULL)
+    {
+        perror("malloc");
+        return;
+    }
+    task->parent = parent != NULL ? retainSearchDir(parent) : NULL;
+    task->name = strdup(name);
+    task->path = strdup(path);
+
+    atomic_fetch_add(&ctx->pending, 1);
+    atomic_fetch_add(&ctx->queued, 1);
+    pushSearchTask(&worker->deque, task);
+
+    pthread_mutex_lock(&ctx->idleLock);
+    pthread_cond_signal(&ctx->idleCond);
+    pthread_mutex_unlock(&ctx->idleLock);
+}
+
+void finishSearchTask(struct searchContext *ctx, struct searchTask *task)
+{
+    releaseSearchDir(task->parent);
+    free(task->name);
+    free(task->path);
+    free(task);
+
+    if (atomic_fetch_sub(&ctx->pending, 1) == 1)
+    {
+        pthread_mutex_lock(&ctx->idleLock);
+        pthread_cond_broadcast(&ctx->idleCond);
+        pthread_mutex_unlock(&ctx->idleLock);
+    }
+}
+
+// io_uring backend (--io-uring): each worker owns a ring and a fixed set of
+// file slots. Every regular file a directory yields is queued as an openat;
+// its completion queues a read of the whole file, and the read's completion
+// scans the buffer and queues the close. Dozens of files are in flight while
+// the worker scans whichever finished first. Large files still go through
+// mmap, and workers whose ring cannot be set up use blocking reads.
+int openUringQueue(struct uringQueue *q)
+{
+    struct io_uring_params params;
+
+    memset(q, 0, sizeof(struct uringQueue));
+    memset(&params, 0, sizeof(params));
+    q->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (q->fd == -1)
+    {
+        return -1;
+    }
+
+    // openat, read and close must all be supported by this kernel
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probeSize);
+    if (probe == NULL || syscall(__NR_io_uring_register, q->fd, IORING_REGISTER_PROBE, probe, 256) == -1 ||
+        probe->last_op < IORING_OP_CLOSE || !(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) ||
+        !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) ||
+        !(probe->ops[IORING_OP_CLOSE].flags & IO_URING_OP_SUPPORTED))
+    {
+        free(probe);
+        close(q->fd);
+        return -1;
+    }
+    free(probe);
+
+    q->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    q->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        q->sqRingSize = q->cqRingSize = q->sqRingSize > q->cqRingSize ? q->sqRingSize : q->cqRingSize;
+    }
+    q->sqRing = mmap(NULL, q->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQ_RING);
+    if (q->sqRing == MAP_FAILED)
+    {
+        close(q->fd);
+        return -1;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        q->cqRing = q->sqRing;
+    }
+    else
+    {
+        q->cqRing = mmap(NULL, q->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_CQ_RING);
+    }
+    q->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    q->sqes = mmap(NULL, q->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES);
+    if (q->cqRing == MAP_FAILED || q->sqes == MAP_FAILED)
+    {
+        if (q->cqRing != MAP_FAILED && q->cqRing != q->sqRing)
+        {
+            munmap(q->cqRing, q->cqRingSize);
+        }
+        munmap(q->sqRing, q->sqRingSize);
+        close(q->fd);
+        return -1;
+    }
+
+    char *sq = q->sqRing;
+    char *cq = q->cqRing;
+    q->sqHead = (unsigned *)(sq + params.sq_off.head);
+    q->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    q->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    q->sqEntries = params.sq_entries;
+    q->sqArray = (unsigned *)(sq + params.sq_off.array);
+    q->cqHead = (unsigned *)(cq + params.cq_off.head);
+    q->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    q->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    q->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    for (int i = 0; i < URING_FILES; i++)
+    {
+        q->freeFiles[i] = URING_FILES - 1 - i;
+    }
+    q->freeCount = URING_FILES;
+    return 0;
+}
+
+void closeUringQueue(struct uringQueue *q)
+{
+    for (int i = 0; i < URING_FILES; i++)
+    {
+        free(q->files[i].data);
+    }
+    munmap(q->sqes, q->sqesSize);
+    if (q->cqRing != q->sqRing)
+    {
+        munmap(q->cqRing, q->cqRingSize);
+    }
+    munmap(q->sqRing, q->sqRingSize);
+    close(q->fd);
+}
+
+// Hands the queued entries to the kernel, optionally waiting for completions
+void submitUring(struct uringQueue *q, unsigned waitFor)
+{
+    while (q->unsubmitted > 0 || waitFor > 0)
+    {
+        long n = syscall(__NR_io_uring_enter, q->fd, q->unsubmitted, waitFor,
+                         waitFor > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n == -1)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+            {
+                continue;
+            }
+            perror("io_uring_enter");
+            q->failed = 1;
+            return;
+        }
+        q->unsubmitted -= n;
+        waitFor = 0;
+    }
+}
+
+struct io_uring_sqe *nextUringSqe(struct uringQueue *q, int op, int fd, int slot)
+{
+    unsigned tail = *q->sqTail;
+
+    if (tail - __atomic_load_n(q->sqHead, __ATOMIC_ACQUIRE) == q->sqEntries)
+    {
+        submitUring(q, 0);
+    }
+    struct io_uring_sqe *sqe = &q->sqes[tail & q->sqMask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = slot;
+    q->sqArray[tail & q->sqMask] = tail & q->sqMask;
+    return sqe;
+}
+
+// Publishes the entry nextUringSqe() returned once it is filled in
+void pushUringSqe(struct uringQueue *q)
+{
+    __atomic_store_n(q->sqTail, *q->sqTail + 1, __ATOMIC_RELEASE);
+    q->unsubmitted++;
+}
+
+void queueUringRead(struct uringQueue *q, int slot)
+{
+    struct uringFile *file = &q->files[slot];
+    struct io_uring_sqe *sqe = nextUringSqe(q, IORING_OP_READ, file->fd, slot);
+
+    sqe->addr = (uintptr_t)(file->data + file->done);
+    sqe->len = file->st.st_size - file->done;
+    sqe->off = file->done;
+    file->state = URING_READ;
+    pushUringSqe(q);
+}
+
+void queueUringClose(struct uringQueue *q, int slot)
+{
+    struct uringFile *file = &q->files[slot];
+
+    nextUringSqe(q, IORING_OP_CLOSE, file->fd, slot);
+    file->state = URING_CLOSE;
+    pushUringSqe(q);
+}
+
+void releaseUringFile(struct uringQueue *q, int slot)
+{
+    q->files[slot].state = URING_IDLE;
+    q->freeFiles[q->freeCount++] = slot;
+    q->active--;
+}
+
+void handleUringCompletion(struct searchWorker *worker, int slot, int res)
+{
+    struct uringQueue *q = worker->uring;
+    struct uringFile *file = &q->files[slot];
+    struct searchContext *ctx = worker->ctx;
+    off_t maxSize = ctx->options->maxFileSize;
+
+    switch (file->state)
+    {
+    case URING_OPEN:
+        releaseSearchDir(file->dir);
+        file->dir = NULL;
+        if (res < 0)
+        {
+            fprintf(stderr, "fopen: %s\n", strerror(-res));
+            releaseUringFile(q, slot);
+            return;
+        }
+        file->fd = res;
+        if (fstat(file->fd, &file->st) == -1)
+        {
+            perror("fstat");
+            queueUringClose(q, slot);
+            return;
+        }
+        if (file->st.st_size == 0 || (maxSize > 0 && file->st.st_size > maxSize))
+        {
+            if (ctx->cache != NULL)
+            {
+                beginCacheEntry(worker, &file->st);
+                endCacheEntry(worker);
+            }
+            queueUringClose(q, slot);
+            return;
+        }
+        if (file->st.st_size >= SCAN_MMAP_THRESHOLD)
+        {
+            // Mapped with readahead instead; the helper closes the descriptor
+            if (ctx->cache != NULL)
+            {
+                beginCacheEntry(worker, &file->st);
+            }
+            searchFilesKaragulHelper(worker, file->fd, file->path);
+            if (ctx->cache != NULL)
+            {
+                endCacheEntry(worker);
+            }
+            releaseUringFile(q, slot);
+            return;
+        }
+        if (file->capacity < (size_t)file->st.st_size)
+        {
+            free(file->data);
+            file->capacity = SCAN_MMAP_THRESHOLD;
+            file->data = malloc(file->capacity);
+            if (file->data == NULL)
+            {
+                perror("malloc");
+                file->capacity = 0;
+                queueUringClose(q, slot);
+                return;
+            }
+        }
+        file->done = 0;
+        queueUringRead(q, slot);
+        return;
+
+    case URING_READ:
+        if (res == -EINTR || res == -EAGAIN)
+        {
+            queueUringRead(q, slot);
+            return;
+        }
+        if (res < 0)
+        {
+            fprintf(stderr, "read: %s\n", strerror(-res));
+            queueUringClose(q, slot);
+            return;
+        }
+        file->done += res;
+        if (res > 0 && file->done < (size_t)file->st.st_size)
+        {
+            queueUringRead(q, slot);
+            return;
+        }
+        if (ctx->cache != NULL)
+        {
+            beginCacheEntry(worker, &file->st);
+        }
+        if (file->done > 0)
+        {
+            searchFileText(worker, file->data, file->done, file->path);
+        }
+        if (ctx->cache != NULL)
+        {
+            endCacheEntry(worker);
+        }
+        queueUringClose(q, slot);
+        return;
+
+    case URING_CLOSE:
+        releaseUringFile(q, slot);
+        return;
+    }
+}
+
+// Handles every completion that has arrived, first waiting for one if asked
+// to. Returns -1 once the ring failed and the worker has fallen back to
+// blocking reads.
+int reapUring(struct searchWorker *worker, int wait)
+{
+    struct uringQueue *q = worker->uring;
+    unsigned head = *q->cqHead;
+
+    submitUring(q, wait && head == __atomic_load_n(q->cqTail, __ATOMIC_ACQUIRE) ? 1 : 0);
+    while (head != __atomic_load_n(q->cqTail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe cqe = q->cqes[head & q->cqMask];
+        __atomic_store_n(q->cqHead, ++head, __ATOMIC_RELEASE);
+        handleUringCompletion(worker, (int)cqe.user_data, cqe.res);
+    }
+    if (q->failed)
+    {
+        abandonUring(worker);
+        return -1;
+    }
+    return 0;
+}
+
+// After io_uring_enter failed: a file whose next request never reached the
+// kernel is finished with blocking calls, one with a request in flight is
+// reported as not searched, and the worker goes on without its ring
+void abandonUring(struct searchWorker *worker)
+{
+    struct uringQueue *q = worker->uring;
+    unsigned char unsubmitted[URING_FILES];
+    unsigned tail = *q->sqTail;
+
+    memset(unsubmitted, 0, sizeof(unsubmitted));
+    for (unsigned i = tail - q->unsubmitted; i != tail; i++)
+    {
+        unsubmitted[q->sqes[q->sqArray[i & q->sqMask]].user_data] = 1;
+    }
+
+    for (int slot = 0; slot < URING_FILES; slot++)
+    {
+        struct uringFile *file = &q->files[slot];
+
+        if (file->state == URING_IDLE || (file->state == URING_CLOSE && !unsubmitted[slot]))
+        {
+            continue;
+        }
+        if (file->state == URING_CLOSE)
+        {
+            close(file->fd);
+        }
+        else if (!unsubmitted[slot])
+        {
+            fprintf(stderr, "search: %s: not searched, its io_uring request was lost\n", file->path);
+            atomic_store(&worker->ctx->dropped, 1);
+            if (file->state == URING_READ)
+            {
+                // The kernel may still write into the buffer
+                file->data = NULL;
+                file->capacity = 0;
+                close(file->fd);
+            }
+        }
+        else if (file->state == URING_READ)
+        {
+            // Nothing was read through the descriptor, its offset is still 0
+            searchOpenedFile(worker, file->fd, file->path);
+        }
+        else
+        {
+            int fd = openat(file->dir->fd, file->name, O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+            {
+                perror("fopen");
+            }
+            else
+            {
+                searchOpenedFile(worker, fd, file->path);
+            }
+        }
+        if (file->dir != NULL)
+        {
+            releaseSearchDir(file->dir);
+            file->dir = NULL;
+        }
+        file->state = URING_IDLE;
+    }
+
+    fprintf(stderr, "search: io_uring failed, using blocking reads\n");
+    closeUringQueue(q);
+    free(q);
+    worker->uring = NULL;
+}
+
+// Returns -1 when the ring is gone and the caller has to read the file itself
+int queueUringFile(struct searchWorker *worker, struct searchDir *dir, const char *name, const char *path)
+{
+    struct uringQueue *q = worker->uring;
+
+    while (q->freeCount == 0)
+    {
+        if (reapUring(worker, 1) == -1)
+        {
+            return -1;
+        }
+    }
+    int slot = q->freeFiles[--q->freeCount];
+    struct uringFile *file = &q->files[slot];
+
+    q->active++;
+    file->state = URING_OPEN;
+    file->dir = retainSearchDir(dir);
+    snprintf(file->name, sizeof(file->name), "%s", name);
+    snprintf(file->path, sizeof(file->path), "%s", path);
+
+    struct io_uring_sqe *sqe = nextUringSqe(q, IORING_OP_OPENAT, dir->fd, slot);
+    sqe->addr = (uintptr_t)file->name;
+    sqe->open_flags = O_RDONLY | O_CLOEXEC;
+    pushUringSqe(q);
+    return 0;
+}
+
+void drainUring(struct searchWorker *worker)
+{
+    while (worker->uring->active > 0)
+    {
+        if (reapUring(worker, 1) == -1)
+        {
+            return;
+        }
+    }
+}
+
+// A directory's entries in the order their paths sort in: a subdirectory
+// sorts as its name followed by '/', so visiting the entries depth first
+// yields paths in strcmp() order
+int compareSortedEntries(const void *a, const void *b)
+{
+    const struct sortedEntry *x = a;
+    const struct sortedEntry *y = b;
+    const unsigned char *p = (const unsigned char *)x->name;
+    const unsigned char *q = (const unsigned char *)y->name;
+
+    while (*p != '\0' && *p == *q)
+    {
+        p++;
+        q++;
+    }
+    int c = *p != '\0' ? *p : x->type == DT_DIR ? '/' : 0;
+    int d = *q != '\0' ? *q : y->type == DT_DIR ? '/' : 0;
+    return c - d;
+}
+
+// Reads a whole directory and sorts it; NULL with *count 0 on errors
+struct sortedEntry *readSortedEntries(int dirFd, char *buffer, size_t *count)
+{
+    struct dirIterator it;
+    struct sortedEntry *entries = NULL;
+    size_t capacity = 0;
+    const char *name;
+    unsigned char type;
+    int result;
+
+    *count = 0;
+    initDirIterator(&it, dirFd, buffer, DIRENT_BUFFER_SIZE);
+    while ((result = nextDirEntry(&it, &name, &type)) == 1)
+    {
+        if (*count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            struct sortedEntry *grown = realloc(entries, capacity * sizeof(struct sortedEntry));
+            if (grown == NULL)
+            {
+                perror("realloc");
+                break;
+            }
+            entries = grown;
+        }
+        if ((entries[*count].name = strdup(name)) == NULL)
+        {
+            perror("strdup");
+            break;
+        }
+        entries[(*count)++].type = type;
+    }
+    if (result == -1)
+    {
+        perror("getdents64");
+    }
+    qsort(entries, *count, sizeof(struct sortedEntry), compareSortedEntries);
+    return entries;
+}
+
+void freeSortedEntries(struct sortedEntry *entries, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        free(entries[i].name);
+    }
+    free(entries);
+}
+
+// --sorted: a queued file is scanned into its own sink, whichever worker
+// claims it; the cache entry still goes to that worker's cache output
+void scanOrderedFile(struct searchWorker *worker, struct orderedFile *file)
+{
+    if (atomic_load_explicit(&worker->ctx->stopped, memory_order_relaxed))
+    {
+        if (file->fd != -1)
+        {
+            close(file->fd);
+        }
+        return;
+    }
+    if (file->cached != NULL)
+    {
+        replayCachedFile(worker, file->cached, file->path);
+    }
+    else if (file->cacheable)
+    {
+        beginCacheEntry(worker, &file->st);
+        searchFilesKaragulHelper(worker, file->fd, file->path);
+        endCacheEntry(worker);
+    }
+    else
+    {
+        searchFilesKaragulHelper(worker, file->fd, file->path);
+    }
+    file->sink = worker->sink;
+    memset(&worker->sink, 0, sizeof(struct resultSink));
+}
+
+// Claims and scans the oldest unclaimed file of the window, then writes out
+// the files at its head that are done. Called and returns with outputLock held.
+void runOrderedFile(struct searchWorker *worker)
+{
+    struct searchContext *ctx = worker->ctx;
+    struct orderedFile *file = &ctx->ordered[ctx->orderNext++ % ORDER_WINDOW];
+
+    pthread_mutex_unlock(&ctx->outputLock);
+    scanOrderedFile(worker, file);
+    pthread_mutex_lock(&ctx->outputLock);
+    file->done = 1;
+
+    while (ctx->orderHead < ctx->orderNext && (file = &ctx->ordered[ctx->orderHead % ORDER_WINDOW])->done)
+    {
+        writeResultSink(ctx, &file->sink);
+        free(file->sink.data);
+        free(file->path);
+        memset(file, 0, sizeof(struct orderedFile));
+        ctx->orderHead++;
+    }
+    pthread_cond_broadcast(&ctx->orderCond);
+}
+
+// Adds a file to the window. When the window is full the walk helps with
+// the scanning instead of waiting, unless every file in it is claimed.
+void queueOrderedFile(struct searchWorker *worker, struct searchDir *dir, const char *name, const char *path)
+{
+    struct searchContext *ctx = worker->ctx;
+    struct stat st;
+    const char *cached = NULL;
+    int cacheable = 0;
+    int fd = -1;
+
+    if (ctx->cache != NULL && fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0)
+    {
+        cached = lookupSearchCache(ctx->cache, &st);
+    }
+    if (cached == NULL)
+    {
+        fd = openat(dir->fd, name, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            perror("fopen");
+            return;
+        }
+        // The entry is keyed by what was opened, not by the earlier stat
+        cacheable = ctx->cache != NULL && fstat(fd, &st) == 0;
+    }
+
+    pthread_mutex_lock(&ctx->outputLock);
+    while (ctx->orderTail - ctx->orderHead == ORDER_WINDOW)
+    {
+        if (ctx->orderNext < ctx->orderTail)
+        {
+            runOrderedFile(worker);
+        }
+        else
+        {
+            pthread_cond_wait(&ctx->orderCond, &ctx->outputLock);
+        }
+    }
+    struct orderedFile *file = &ctx->ordered[ctx->orderTail % ORDER_WINDOW];
+    file->fd = fd;
+    file->cached = cached;
+    file->cacheable = cacheable;
+    if (cacheable)
+    {
+        file->st = st;
+    }
+    file->path = strdup(path);
+    ctx->orderTail++;
+    pthread_cond_broadcast(&ctx->orderCond);
+    pthread_mutex_unlock(&ctx->outputLock);
+}
+
+// --sorted workers scan the window until the walk is over and it is empty
+void *orderedWorkerMain(void *arg)
+{
+    struct searchWorker *worker = arg;
+    struct searchContext *ctx = worker->ctx;
+
+    pthread_mutex_lock(&ctx->outputLock);
+    while (ctx->orderNext < ctx->orderTail || !ctx->walkDone)
+    {
+        if (ctx->orderNext < ctx->orderTail)
+        {
+            runOrderedFile(worker);
+        }
+        else
+        {
+            pthread_cond_wait(&ctx->orderCond, &ctx->outputLock);
+        }
+    }
+    pthread_mutex_unlock(&ctx->outputLock);
+    return NULL;
+}
+
+// Scans an open file and closes it; with the cache on it gets an entry keyed
+// by what was opened, not by an earlier stat of the name
+void searchOpenedFile(struct searchWorker *worker, int fd, const char *path)
+{
+    struct stat st;
+
+    if (worker->ctx->cache != NULL && fstat(fd, &st) == 0)
+    {
+        beginCacheEntry(worker, &st);
+        searchFilesKaragulHelper(worker, fd, path);
+        endCacheEntry(worker);
+    }
+    else
+    {
+        searchFilesKaragulHelper(worker, fd, path);
+    }
+}
+
+// One entry of a directory being searched: files are scanned inline, or queued
+// in path order with --sorted; subdirectories become tasks, or are walked
+// right away with --sorted so the walk stays in path order
+void searchDirectoryEntry(struct searchWorker *worker, struct searchDir *dir, const char *name, unsigned char type)
+{
+    struct searchContext *ctx = worker->ctx;
+    char childPath[MAX_FILE_NAME_SIZE];
+
+    if (type == DT_REG)
+    {
+        if (matchesFileType(ctx->options->fileFilter, name))
+        {
+            snprintf(childPath, sizeof(childPath), "%s/%s", dir->path, name);
+            if (dir->scope != NULL && isIgnored(dir->scope, childPath, name, 0))
+            {
+                return;
+            }
+            if (ctx->ordered != NULL)
+            {
+                queueOrderedFile(worker, dir, name, childPath);
+                return;
+            }
+            struct stat st;
+            const char *cached;
+            if (ctx->cache != NULL && fstatat(dir->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                (cached = lookupSearchCache(ctx->cache, &st)) != NULL)
+            {
+                replayCachedFile(worker, cached, childPath);
+                return;
+            }
+            if (worker->uring != NULL && queueUringFile(worker, dir, name, childPath) == 0)
+            {
+                return;
+            }
+            int fileFd = openat(dir->fd, name, O_RDONLY | O_CLOEXEC);
+            if (fileFd == -1)
+            {
+                perror("fopen");
+                return;
+            }
+            searchOpenedFile(worker, fileFd, childPath);
+        }
+    }
+    else if (ctx->options->recursive && type == DT_DIR)
+    {
+        snprintf(childPath, sizeof(childPath), "%s/%s", dir->path, name);
+        // Ignored subtrees are never opened
+        if (dir->scope != NULL && isIgnored(dir->scope, childPath, name, 1))
+        {
+            return;
+        }
+        if (ctx->ordered != NULL)
+        {
+            struct searchTask child = {dir, (char *)name, childPath};
+            searchDirectory(worker, &child);
+            return;
+        }
+        scheduleSearchTask(worker, dir, name, childPath);
+    }
+}
+
+// Scans the files of one directory inline and hands its subdirectories out as tasks
+void searchDirectory(struct searchWorker *worker, struct searchTask *task)
+{
+    struct searchContext *ctx = worker->ctx;
+    int fd;
+
+    if (task->parent == NULL)
+    {
+        fd = open(task->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    else
+    {
+        fd = openat(task->parent->fd, task->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if (fd == -1)
+    {
+        perror("opendir");
+        return;
+    }
+
+    struct searchDir *dir = malloc(sizeof(struct searchDir));
+    if (dir == NULL)
+    {
+        perror("malloc");
+        close(fd);
+        return;
+    }
+    dir->fd = fd;
+    dir->path = strdup(task->path);
+    dir->scope = NULL;
+    atomic_init(&dir->refs, 1);
+    if (!ctx->options->noIgnore)
+    {
+        dir->scope = loadIgnoreScope(task->parent != NULL ? task->parent->scope : NULL, fd, dir->path);
+    }
+
+    struct dirIterator it;
+    const char *name;
+    unsigned char type;
+    int result = 0;
+
+    if (worker->direntBuffer == NULL && (worker->direntBuffer = malloc(DIRENT_BUFFER_SIZE)) == NULL)
+    {
+        perror("malloc");
+        releaseSearchDir(dir);
+        return;
+    }
+    if (ctx->ordered != NULL)
+    {
+        // Read in full first: the walk below reuses the dirent buffer
+        size_t count;
+        struct sortedEntry *entries = readSortedEntries(dir->fd, worker->direntBuffer, &count);
+        for (size_t i = 0; i < count && !atomic_load_explicit(&ctx->stopped, memory_order_relaxed); i++)
+        {
+            searchDirectoryEntry(worker, dir, entries[i].name, entries[i].type);
+        }
+        freeSortedEntries(entries, count);
+        releaseSearchDir(dir);
+        return;
+    }
+    initDirIterator(&it, dir->fd, worker->direntBuffer, DIRENT_BUFFER_SIZE);
+    while (!atomic_load_explicit(&ctx->stopped, memory_order_relaxed) &&
+           (result = nextDirEntry(&it, &name, &type)) == 1)
+    {
+        searchDirectoryEntry(worker, dir, name, type);
+    }
+
+    if (result == -1)
+    {
+        perror("getdents64");
+    }
+    if (worker->uring != NULL)
+    {
+        // Get the batch moving before the next directory is read
+        reapUring(worker, 0);
+    }
+    releaseSearchDir(dir);
+}
+
+struct searchTask *findSearchTask(struct searchWorker *worker)
+{
+    struct searchContext *ctx = worker->ctx;
+    struct searchTask *task = popSearchTask(&worker->deque);
+
+    for (int i = 1; task == NULL && i < ctx->workerCount; i++)
+    {
+        task = stealSearchTask(&ctx->workers[(worker->id + i) % ctx->workerCount].deque);
+    }
+    if (task != NULL)
+    {
+        atomic_fetch_sub(&ctx->queued, 1);
+    }
+    return task;
+}
+
+void *searchWorkerMain(void *arg)
+{
+    struct searchWorker *worker = arg;
+    struct searchContext *ctx = worker->ctx;
+
+    while (1)
+    {
+        struct searchTask *task = findSearchTask(worker);
+
+        if (task != NULL)
+        {
+            // After -q has its answer the remaining tasks are only drained
+            if (!atomic_load_explicit(&ctx->stopped, memory_order_relaxed))
+            {
+                searchDirectory(worker, task);
+            }
+            finishSearchTask(ctx, task);
+            continue;
+        }
+        if (worker->uring != NULL && worker->uring->active > 0)
+        {
+            drainUring(worker);
+            continue;
+        }
+
+        // Nothing to steal: sleep until a task is queued or the walk is over
+        pthread_mutex_lock(&ctx->idleLock);
+        while (atomic_load(&ctx->queued) == 0 && atomic_load(&ctx->pending) > 0)
+        {
+            pthread_cond_wait(&ctx->idleCond, &ctx->idleLock);
+        }
+        int done = atomic_load(&ctx->pending) == 0;
+        pthread_mutex_unlock(&ctx->idleLock);
+
+        if (done)
+        {
+            return NULL;
+        }
+    }
+}
+
+int initSearchContext(struct searchContext *ctx, struct searchOptions *options, int jobs)
+{
+    memset(ctx, 0, sizeof(struct searchContext));
+    ctx->options = options;
+    ctx->searchLength = strlen(options->searchString);
+    if (options->useRegex && (ctx->regex = compileRegex(options->searchString)) == NULL)
+    {
+        return -1;
+    }
+    if (options->patternCount > 1 && (ctx->automaton = buildAhoCorasick(options->patterns, options->patternCount)) == NULL)
+    {
+        freeRegexProgram(ctx->regex);
+        return -1;
+    }
+    ctx->workerCount = jobs;
+    atomic_init(&ctx->pending, 0);
+    atomic_init(&ctx->queued, 0);
+    atomic_init(&ctx->matched, 0);
+    atomic_init(&ctx->stopped, 0);
+
+    ctx->workers = calloc(jobs, sizeof(struct searchWorker));
+    if (ctx->workers == NULL)
+    {
+        perror("calloc");
+        freeAhoCorasick(ctx->automaton);
+        freeRegexProgram(ctx->regex);
+        return -1;
+    }
+    pthread_mutex_init(&ctx->idleLock, NULL);
+    pthread_cond_init(&ctx->idleCond, NULL);
+    pthread_mutex_init(&ctx->outputLock, NULL);
+    pthread_cond_init(&ctx->orderCond, NULL);
+    for (int i = 0; i < jobs; i++)
+    {
+        ctx->workers[i].id = i;
+        ctx->workers[i].ctx = ctx;
+        ctx->workers[i].cacheEntry = SIZE_MAX;
+        pthread_mutex_init(&ctx->workers[i].deque.lock, NULL);
+    }
+    return 0;
+}
+
+void destroySearchContext(struct searchContext *ctx)
+{
+    flushSearchOutput(ctx);
+    for (int i = 0; i < ctx->workerCount; i++)
+    {
+        free(ctx->workers[i].sink.data);
+        free(ctx->workers[i].cacheOut.data);
+        pthread_mutex_destroy(&ctx->workers[i].deque.lock);
+        free(ctx->workers[i].deque.items);
+        free(ctx->workers[i].buffer);
+        free(ctx->workers[i].direntBuffer);
+        destroyLazyDfa(&ctx->workers[i].dfa);
+        if (ctx->workers[i].uring != NULL)
+        {
+            closeUringQueue(ctx->workers[i].uring);
+            free(ctx->workers[i].uring);
+        }
+    }
+    free(ctx->workers);
+    pthread_mutex_destroy(&ctx->idleLock);
+    pthread_cond_destroy(&ctx->idleCond);
+    pthread_mutex_destroy(&ctx->outputLock);
+    pthread_cond_destroy(&ctx->orderCond);
+    freeAhoCorasick(ctx->automaton);
+    freeRegexProgram(ctx->regex);
+}
+
+// Returns 1 if anything matched, 0 if not, -1 if the search could not run
+int searchFilesKaragul(struct searchOptions *options)
+{
+    struct searchContext ctx;
+    struct searchCache cache;
+    char startDir[MAX_FILE_NAME_SIZE];
+    int jobs = options->jobs;
+
+    if (getcwd(startDir, sizeof(startDir)) == NULL)
+    {
+        perror("getcwd");
+        return -1;
+    }
+
+    if (jobs < 1 || !options->recursive)
+    {
+        jobs = 1;
+    }
+
+    // Matches bypass stdio from here on
+    fflush(stdout);
+    if (initSearchContext(&ctx, options, jobs) == -1)
+    {
+        return -1;
+    }
+    if (!options->noCache && openSearchCache(&cache, options, startDir) == 0)
+    {
+        ctx.cache = &cache;
+    }
+    if (options->sorted && (ctx.ordered = calloc(ORDER_WINDOW, sizeof(struct orderedFile))) == NULL)
+    {
+        perror("calloc");
+        options->sorted = 0;
+    }
+    // Every worker gets a ring or none does
+    for (int i = 0; options->ioUring && !options->sorted && i < jobs; i++)
+    {
+        struct uringQueue *q = malloc(sizeof(struct uringQueue));
+        if (q == NULL || openUringQueue(q) == -1)
+        {
+            fprintf(stderr, "search: io_uring unavailable, using blocking reads\n");
+            free(q);
+            for (int j = 0; j < i; j++)
+            {
+                closeUringQueue(ctx.workers[j].uring);
+                free(ctx.workers[j].uring);
+                ctx.workers[j].uring = NULL;
+            }
+            break;
+        }
+        ctx.workers[i].uring = q;
+    }
+
+    void *(*workerMain)(void *) = ctx.ordered != NULL ? orderedWorkerMain : searchWorkerMain;
+    if (ctx.ordered == NULL)
+    {
+        scheduleSearchTask(&ctx.workers[0], NULL, startDir, startDir);
+    }
+
+    // The calling thread is worker 0; with --sorted it walks the tree first
+    for (int i = 1; i < jobs; i++)
+    {
+        if (pthread_create(&ctx.workers[i].thread, NULL, workerMain, &ctx.workers[i]) != 0)
+        {
+            perror("pthread_create");
+            ctx.workers[i].thread = 0;
+        }
+    }
+    if (ctx.ordered != NULL)
+    {
+        struct searchTask root = {NULL, startDir, startDir};
+        searchDirectory(&ctx.workers[0], &root);
+        pthread_mutex_lock(&ctx.outputLock);
+        ctx.walkDone = 1;
+        pthread_cond_broadcast(&ctx.orderCond);
+        pthread_mutex_unlock(&ctx.outputLock);
+    }
+    workerMain(&ctx.workers[0]);
+    for (int i = 1; i < jobs; i++)
+    {
+        if (ctx.workers[i].thread != 0)
+        {
+            pthread_join(ctx.workers[i].thread, NULL);
+        }
+    }
+
+    if (ctx.cache != NULL)
+    {
+        // An abandoned walk has not seen every file of the query
+        if (!atomic_load(&ctx.stopped))
+        {
+            saveSearchCache(&ctx);
+        }
+        closeSearchCache(&cache);
+        free(cache.key);
+    }
+    int matched = atomic_load(&ctx.matched);
+    destroySearchContext(&ctx);
+    free(ctx.ordered);
+    // Whatever was lost has been reported; the search failed
+    return atomic_load(&ctx.dropped) ? -1 : matched;
+}
+
+// Trigram index: every source file below a directory is recorded with its
+// (inode, size, mtime) and, for each distinct 3-byte sequence, the sorted list
+// of files containing it. Queries intersect the lists of the pattern's
+// trigrams and only scan the files that survive.
+uint32_t trigramAt(const char *text)
+{
+    return ((uint32_t)(unsigned char)text[0] << 16) | ((uint32_t)(unsigned char)text[1] << 8) | (unsigned char)text[2];
+}
+
+int compareUint32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Sorted, duplicate-free trigrams of text; returns how many were stored in *out
+size_t collectTrigrams(const char *text, size_t len, uint32_t **out)
+{
+    size_t count = len < 3 ? 0 : len - 2;
+    size_t unique = 0;
+
+    *out = malloc((count ? count : 1) * sizeof(uint32_t));
+    if (*out == NULL)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        (*out)[i] = trigramAt(text + i);
+    }
+    qsort(*out, count, sizeof(uint32_t), compareUint32);
+    for (size_t i = 0; i < count; i++)
+    {
+        if (unique == 0 || (*out)[unique - 1] != (*out)[i])
+        {
+            (*out)[unique++] = (*out)[i];
+        }
+    }
+    return unique;
+}
+
+struct postingList *findPostingList(struct trigramTable *table, uint32_t trigram)
+{
+    if ((table->count + 1) * 2 > table->capacity)
+    {
+        size_t oldCapacity = table->capacity;
+        struct postingList *oldSlots = table->slots;
+
+        table->capacity = oldCapacity ? oldCapacity * 2 : 4096;
+        table->slots = calloc(table->capacity, sizeof(struct postingList));
+        if (table->slots == NULL)
+        {
+            perror("calloc");
+            exit(EXIT_FAILURE);
+        }
+        for (size_t i = 0; i < oldCapacity; i++)
+        {
+            if (oldSlots[i].ids != NULL)
+            {
+                size_t slot = (oldSlots[i].trigram * 2654435761u) & (table->capacity - 1);
+                while (table->slots[slot].ids != NULL)
+                {
+                    slot = (slot + 1) & (table->capacity - 1);
+                }
+                table->slots[slot] = oldSlots[i];
+            }
+        }
+        free(oldSlots);
+    }
+
+    size_t slot = (trigram * 2654435761u) & (table->capacity - 1);
+    while (table->slots[slot].ids != NULL && table->slots[slot].trigram != trigram)
+    {
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+    return &table->slots[slot];
+}
+
+void addPosting(struct trigramTable *table, uint32_t trigram, uint32_t fileId)
+{
+    struct postingList *list = findPostingList(table, trigram);
+
+    if (list->ids == NULL)
+    {
+        list->trigram = trigram;
+        list->capacity = 4;
+        list->ids = malloc(list->capacity * sizeof(uint32_t));
+        if (list->ids == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        table->count++;
+    }
+    else if (list->count == list->capacity)
+    {
+        list->capacity *= 2;
+        list->ids = realloc(list->ids, list->capacity * sizeof(uint32_t));
+        if (list->ids == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    list->ids[list->count++] = fileId;
+}
+
+int openTrigramIndex(const char *dir, struct trigramIndex *index)
+{
+    char indexPath[MAX_FILE_NAME_SIZE];
+    struct stat st;
+
+    memset(index, 0, sizeof(struct trigramIndex));
+    snprintf(indexPath, sizeof(indexPath), "%s/%s", dir, INDEX_FILE_NAME);
+
+    int fd = open(indexPath, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct indexHeader))
+    {
+        close(fd);
+        return -1;
+    }
+
+    index->size = st.st_size;
+    index->map = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index->map == MAP_FAILED)
+    {
+        index->map = NULL;
+        return -1;
+    }
+
+    if (checkTrigramIndex(index) == -1)
+    {
+        fprintf(stderr, "search: %s is not a valid index\n", indexPath);
+        munmap(index->map, index->size);
+        index->map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Checks the sections, then every record against them: a file's path must be
+// NUL-terminated inside the paths section and a trigram's postings must be
+// sorted ids of indexed files. Sets up the section pointers on success.
+int checkTrigramIndex(struct trigramIndex *index)
+{
+    const struct indexHeader *header = index->map;
+    uint64_t size = index->size;
+
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->filesOffset % 8 != 0 || header->trigramsOffset % 8 != 0 || header->postingsOffset % 4 != 0 ||
+        header->filesOffset < sizeof(struct indexHeader) || header->filesOffset > size ||
+        header->pathsOffset < header->filesOffset + (uint64_t)header->fileCount * sizeof(struct indexFileRecord) ||
+        header->trigramsOffset < header->pathsOffset || header->trigramsOffset > size ||
+        header->postingsOffset < header->trigramsOffset + (uint64_t)header->trigramCount * sizeof(struct indexTrigramRecord) ||
+        header->postingsOffset > size)
+    {
+        return -1;
+    }
+
+    index->header = header;
+    index->files = (const struct indexFileRecord *)((const char *)index->map + header->filesOffset);
+    index->paths = (const char *)index->map + header->pathsOffset;
+    index->trigrams = (const struct indexTrigramRecord *)((const char *)index->map + header->trigramsOffset);
+    index->postings = (const uint32_t *)((const char *)index->map + header->postingsOffset);
+
+    uint64_t pathsLength = header->trigramsOffset - header->pathsOffset;
+    uint64_t postingCount = (size - header->postingsOffset) / sizeof(uint32_t);
+    for (uint32_t id = 0; id < header->fileCount; id++)
+    {
+        uint32_t offset = index->files[id].pathOffset;
+        if (offset >= pathsLength || memchr(index->paths + offset, '\0', pathsLength - offset) == NULL)
+        {
+            return -1;
+        }
+    }
+    for (uint32_t t = 0; t < header->trigramCount; t++)
+    {
+        const struct indexTrigramRecord *record = &index->trigrams[t];
+        if ((t > 0 && record->trigram <= index->trigrams[t - 1].trigram) ||
+            record->first > postingCount || record->count > postingCount - record->first)
+        {
+            return -1;
+        }
+        for (uint32_t p = 0; p < record->count; p++)
+        {
+            uint32_t id = index->postings[record->first + p];
+            if (id >= header->fileCount || (p > 0 && id <= index->postings[record->first + p - 1]))
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Hashes the indexed paths so files can be looked up by path
+int hashIndexPaths(struct trigramIndex *index)
+{
+    index->slotCount = 16;
+    while (index->slotCount < (size_t)index->header->fileCount * 2)
+    {
+        index->slotCount *= 2;
+    }
+    index->slots = malloc(index->slotCount * sizeof(uint32_t));
+    if (index->slots == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    memset(index->slots, 0xff, index->slotCount * sizeof(uint32_t));
+    for (uint32_t id = 0; id < index->header->fileCount; id++)
+    {
+        size_t slot = hashString(index->paths + index->files[id].pathOffset) & (index->slotCount - 1);
+        while (index->slots[slot] != UINT32_MAX)
+        {
+            slot = (slot + 1) & (index->slotCount - 1);
+        }
+        index->slots[slot] = id;
+    }
+    return 0;
+}
+
+void closeTrigramIndex(struct trigramIndex *index)
+{
+    if (index->map != NULL)
+    {
+        munmap(index->map, index->size);
+        index->map = NULL;
+    }
+    free(index->slots);
+    index->slots = NULL;
+}
+
+const struct indexTrigramRecord *findIndexTrigram(const struct trigramIndex *index, uint32_t trigram)
+{
+    size_t low = 0;
+    size_t high = index->header->trigramCount;
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (index->trigrams[mid].trigram < trigram)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    if (low < index->header->trigramCount && index->trigrams[low].trigram == trigram)
+    {
+        return &index->trigrams[low];
+    }
+    return NULL;
+}
+
+// File id by path, UINT32_MAX if path is not indexed; lets a rebuild find what
+// it indexed last time and a query find files added since the build
+uint32_t findIndexedFile(const struct trigramIndex *index, const char *path)
+{
+    if (index->slots == NULL)
+    {
+        return UINT32_MAX;
+    }
+    size_t slot = hashString(path) & (index->slotCount - 1);
+    while (index->slots[slot] != UINT32_MAX)
+    {
+        uint32_t id = index->slots[slot];
+        if (strcmp(index->paths + index->files[id].pathOffset, path) == 0)
+        {
+            return id;
+        }
+        slot = (slot + 1) & (index->slotCount - 1);
+    }
+    return UINT32_MAX;
+}
+
+int sameIndexedFile(const struct indexFileRecord *record, const struct stat *st)
+{
+    return record->ino == (uint64_t)st->st_ino && record->size == (uint64_t)st->st_size &&
+           record->mtimeSec == st->st_mtim.tv_sec && record->mtimeNsec == st->st_mtim.tv_nsec;
+}
+
+void indexSourceFile(struct indexBuild *build, int dirFd, const char *name, const char *relPath)
+{
+    struct stat st;
+
+    if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+    {
+        perror("fstatat");
+        return;
+    }
+
+    // Unchanged since the last build: its postings are copied over afterwards
+    uint32_t oldId = findIndexedFile(&build->old, relPath);
+    if (oldId != UINT32_MAX && !sameIndexedFile(&build->old.files[oldId], &st))
+    {
+        oldId = UINT32_MAX;
+    }
+
+    // A file that cannot be read gets no record, so queries search it instead
+    // of trusting an empty posting set next to matching stat data
+    const char *text = NULL;
+    size_t len = 0;
+    int mapped = 0;
+    if (oldId == UINT32_MAX)
+    {
+        int fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            perror("open");
+            return;
+        }
+        text = loadSearchFile(&build->loader, fd, 0, &len, &mapped);
+        close(fd);
+        if (text == NULL && len > 0)
+        {
+            return;
+        }
+    }
+
+    if (build->fileCount == build->fileCapacity)
+    {
+        build->fileCapacity = build->fileCapacity ? build->fileCapacity * 2 : 256;
+        build->files = realloc(build->files, build->fileCapacity * sizeof(struct indexFileRecord));
+        build->reuse = realloc(build->reuse, build->fileCapacity * sizeof(uint32_t));
+        if (build->files == NULL || build->reuse == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    size_t pathLen = strlen(relPath) + 1;
+    if (build->pathsLength + pathLen > build->pathsCapacity)
+    {
+        while (build->pathsLength + pathLen > build->pathsCapacity)
+        {
+            build->pathsCapacity = build->pathsCapacity ? build->pathsCapacity * 2 : 4096;
+        }
+        build->paths = realloc(build->paths, build->pathsCapacity);
+        if (build->paths == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    uint32_t id = build->fileCount;
+    struct indexFileRecord *record = &build->files[id];
+    record->ino = st.st_ino;
+    record->size = st.st_size;
+    record->mtimeSec = st.st_mtim.tv_sec;
+    record->mtimeNsec = st.st_mtim.tv_nsec;
+    record->pathOffset = build->pathsLength;
+    record->reserved = 0;
+    memcpy(build->paths + build->pathsLength, relPath, pathLen);
+    build->pathsLength += pathLen;
+    build->fileCount++;
+    build->reuse[id] = oldId;
+    if (oldId != UINT32_MAX)
+    {
+        return;
+    }
+
+    build->rescanned++;
+    if (text == NULL)
+    {
+        return;
+    }
+    uint32_t *trigrams;
+    size_t count = collectTrigrams(text, len, &trigrams);
+    for (size_t i = 0; i < count; i++)
+    {
+        addPosting(&build->table, trigrams[i], id);
+    }
+    free(trigrams);
+    if (mapped)
+    {
+        munmap((void *)text, len);
+    }
+}
+
+void indexDirectory(struct indexBuild *build, int dirFd, const char *relDir)
+{
+    struct dirIterator it;
+    const char *name;
+    unsigned char type;
+    int result;
+    char relPath[MAX_FILE_NAME_SIZE];
+    char *buffer = malloc(DIRENT_BUFFER_SIZE);
+
+    if (buffer == NULL)
+    {
+        perror("malloc");
+        return;
+    }
+
+    initDirIterator(&it, dirFd, buffer, DIRENT_BUFFER_SIZE);
+    while ((result = nextDirEntry(&it, &name, &type)) == 1)
+    {
+        if (relDir[0] != '\0')
+        {
+            snprintf(relPath, sizeof(relPath), "%s/%s", relDir, name);
+        }
+        else
+        {
+            snprintf(relPath, sizeof(relPath), "%s", name);
+        }
+
+        if (type == DT_REG && matchesFileType(&build->filter, name))
+        {
+            indexSourceFile(build, dirFd, name, relPath);
+        }
+        else if (type == DT_DIR)
+        {
+            int childFd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (childFd == -1)
+            {
+                perror("opendir");
+                continue;
+            }
+            indexDirectory(build, childFd, relPath);
+            close(childFd);
+        }
+    }
+    if (result == -1)
+    {
+        perror("getdents64");
+    }
+    free(buffer);
+}
+
+int writeTrigramIndex(struct indexBuild *build, const char *dir)
+{
+    char indexPath[MAX_FILE_NAME_SIZE];
+    char tempPath[MAX_FILE_NAME_SIZE + 16];
+    struct indexHeader header;
+    size_t listCount = 0;
+    uint64_t postingCount = 0;
+
+    struct postingList **lists = malloc((build->table.count ? build->table.count : 1) * sizeof(struct postingList *));
+    if (lists == NULL)
+    {
+        perror("malloc");
+        return -1;
+    }
+    for (size_t i = 0; i < build->table.capacity; i++)
+    {
+        struct postingList *list = &build->table.slots[i];
+        if (list->ids != NULL)
+        {
+            // Reused files were appended after the rescanned ones
+            qsort(list->ids, list->count, sizeof(uint32_t), compareUint32);
+            lists[listCount++] = list;
+            postingCount += list->count;
+        }
+    }
+    qsort(lists, listCount, sizeof(struct postingList *), comparePostingLists);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.fileCount = build->fileCount;
+    header.trigramCount = listCount;
+    header.filesOffset = sizeof(header);
+    header.pathsOffset = header.filesOffset + build->fileCount * sizeof(struct indexFileRecord);
+    header.trigramsOffset = (header.pathsOffset + build->pathsLength + 7) & ~(uint64_t)7;
+    header.postingsOffset = header.trigramsOffset + listCount * sizeof(struct indexTrigramRecord);
+
+    snprintf(indexPath, sizeof(indexPath), "%s/%s", dir, INDEX_FILE_NAME);
+    snprintf(tempPath, sizeof(tempPath), "%s.%d", indexPath, getpid());
+    FILE *out = fopen(tempPath, "w");
+    if (out == NULL)
+    {
+        perror("fopen");
+        free(lists);
+        return -1;
+    }
+
+    static const char padding[8];
+    uint64_t first = 0;
+    fwrite(&header, sizeof(header), 1, out);
+    fwrite(build->files, sizeof(struct indexFileRecord), build->fileCount, out);
+    fwrite(build->paths, 1, build->pathsLength, out);
+    fwrite(padding, 1, header.trigramsOffset - header.pathsOffset - build->pathsLength, out);
+    for (size_t i = 0; i < listCount; i++)
+    {
+        struct indexTrigramRecord record = {lists[i]->trigram, lists[i]->count, first};
+        fwrite(&record, sizeof(record), 1, out);
+        first += lists[i]->count;
+    }
+    for (size_t i = 0; i < listCount; i++)
+    {
+        fwrite(lists[i]->ids, sizeof(uint32_t), lists[i]->count, out);
+    }
+    free(lists);
+
+    if (ferror(out) | (fclose(out) != 0))
+    {
+        perror("write");
+        unlink(tempPath);
+        return -1;
+    }
+    // Readers either see the old index or the complete new one
+    if (rename(tempPath, indexPath) == -1)
+    {
+        perror("rename");
+        unlink(tempPath);
+        return -1;
+    }
+    return 0;
+}
+
+int comparePostingLists(const void *a, const void *b)
+{
+    return compareUint32(&(*(struct postingList *const *)a)->trigram, &(*(struct postingList *const *)b)->trigram);
+}
+
+// search --index build DIR: (re)builds DIR's index, rescanning only changed files
+void buildTrigramIndex(const char *dir)
+{
+    struct indexBuild build;
+    char root[MAX_FILE_NAME_SIZE];
+
+    if (realpath(dir, root) == NULL)
+    {
+        perror("realpath");
+        return;
+    }
+
+    memset(&build, 0, sizeof(build));
+    if (compileSuffixTable(&build.filter, NULL, 0) == -1)
+    {
+        return;
+    }
+    if (openTrigramIndex(root, &build.old) == 0 && hashIndexPaths(&build.old) == -1)
+    {
+        closeTrigramIndex(&build.old);
+        freeSuffixTable(&build.filter);
+        return;
+    }
+
+    int rootFd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd == -1)
+    {
+        perror("opendir");
+    }
+    else
+    {
+        indexDirectory(&build, rootFd, "");
+        close(rootFd);
+
+        // Carry the postings of unchanged files over from the previous index
+        if (build.old.map != NULL)
+        {
+            uint32_t *oldToNew = malloc((build.old.header->fileCount + 1) * sizeof(uint32_t));
+            if (oldToNew == NULL)
+            {
+                perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            memset(oldToNew, 0xff, (build.old.header->fileCount + 1) * sizeof(uint32_t));
+            for (uint32_t id = 0; id < build.fileCount; id++)
+            {
+                if (build.reuse[id] != UINT32_MAX)
+                {
+                    oldToNew[build.reuse[id]] = id;
+                }
+            }
+            for (uint32_t t = 0; t < build.old.header->trigramCount; t++)
+            {
+                const struct indexTrigramRecord *record = &build.old.trigrams[t];
+                for (uint32_t p = 0; p < record->count; p++)
+                {
+                    uint32_t newId = oldToNew[build.old.postings[record->first + p]];
+                    if (newId != UINT32_MAX)
+                    {
+                        addPosting(&build.table, record->trigram, newId);
+                    }
+                }
+            }
+            free(oldToNew);
+        }
+
+        if (writeTrigramIndex(&build, root) == 0)
+        {
+            printf("Indexed %zu files under %s (%zu rescanned), %zu trigrams\n",
+                   build.fileCount, root, build.rescanned, build.table.count);
+        }
+    }
+
+    closeTrigramIndex(&build.old);
+    for (size_t i = 0; i < build.table.capacity; i++)
+    {
+        free(build.table.slots[i].ids);
+    }
+    free(build.table.slots);
+    free(build.files);
+    free(build.reuse);
+    free(build.paths);
+    free(build.loader.buffer);
+    freeSuffixTable(&build.filter);
+}
+
+// Marks the files that contain every trigram of pattern
+void markIndexCandidates(const struct trigramIndex *index, const char *pattern, unsigned char *isCandidate)
+{
+    uint32_t fileCount = index->header->fileCount;
+    uint32_t *trigrams = NULL;
+    size_t trigramCount = collectTrigrams(pattern, strlen(pattern), &trigrams);
+
+    if (trigrams == NULL)
+    {
+        perror("malloc");
+        return;
+    }
+
+    if (trigramCount == 0)
+    {
+        // Too short to have trigrams: every indexed file is a candidate
+        memset(isCandidate, 1, fileCount);
+        free(trigrams);
+        return;
+    }
+
+    const struct indexTrigramRecord **records = malloc(trigramCount * sizeof(struct indexTrigramRecord *));
+    if (records == NULL)
+    {
+        perror("malloc");
+        free(trigrams);
+        return;
+    }
+    for (size_t i = 0; i < trigramCount; i++)
+    {
+        records[i] = findIndexTrigram(index, trigrams[i]);
+        if (records[i] == NULL)
+        {
+            free(records);
+            free(trigrams);
+            return;
+        }
+    }
+    free(trigrams);
+
+    // Start from the shortest posting list and intersect the rest into it
+    size_t shortest = 0;
+    for (size_t i = 1; i < trigramCount; i++)
+    {
+        if (records[i]->count < records[shortest]->count)
+        {
+            shortest = i;
+        }
+    }
+    uint32_t *candidates = malloc((records[shortest]->count ? records[shortest]->count : 1) * sizeof(uint32_t));
+    if (candidates == NULL)
+    {
+        perror("malloc");
+        free(records);
+        return;
+    }
+    memcpy(candidates, index->postings + records[shortest]->first, records[shortest]->count * sizeof(uint32_t));
+    size_t candidateCount = records[shortest]->count;
+
+    for (size_t i = 0; i < trigramCount && candidateCount > 0; i++)
+    {
+        const uint32_t *list = index->postings + records[i]->first;
+        size_t kept = 0, p = 0;
+
+        if (i == shortest)
+        {
+            continue;
+        }
+        for (size_t c = 0; c < candidateCount; c++)
+        {
+            while (p < records[i]->count && list[p] < candidates[c])
+            {
+                p++;
+            }
+            if (p < records[i]->count && list[p] == candidates[c])
+            {
+                candidates[kept++] = candidates[c];
+            }
+        }
+        candidateCount = kept;
+    }
+
+    for (size_t c = 0; c < candidateCount; c++)
+    {
+        isCandidate[candidates[c]] = 1;
+    }
+    free(candidates);
+    free(records);
+}
+
+// Searches the candidates under relDir. The index may be older than the tree,
+// so files it does not know and files whose inode, size or mtime changed since
+// the build are searched as well; deleted ones simply are not found. -r and
+// the ignore files are honoured as in searchDirectoryEntry(), so the index
+// only narrows down the files the plain walk would scan.
+void searchIndexedDirectory(struct indexQuery *query, int dirFd, const char *relDir, struct ignoreScope *inherited)
+{
+    const struct searchOptions *options = query->worker->ctx->options;
+    struct dirIterator it;
+    const char *name;
+    unsigned char type;
+    int result = 0;
+    char relPath[MAX_FILE_NAME_SIZE];
+    char filePath[MAX_FILE_NAME_SIZE];
+    char *buffer = malloc(DIRENT_BUFFER_SIZE);
+
+    if (buffer == NULL)
+    {
+        perror("malloc");
+        return;
+    }
+    struct ignoreScope *scope = NULL;
+    if (!options->noIgnore)
+    {
+        if (relDir[0] != '\0')
+        {
+            snprintf(filePath, sizeof(filePath), "%s/%s", query->root, relDir);
+        }
+        else
+        {
+            snprintf(filePath, sizeof(filePath), "%s", query->root);
+        }
+        scope = loadIgnoreScope(inherited, dirFd, filePath);
+    }
+
+    // With --sorted the entries are visited in path order, as the plain walk does
+    struct sortedEntry *entries = NULL;
+    size_t count = 0;
+    size_t next = 0;
+    if (options->sorted)
+    {
+        entries = readSortedEntries(dirFd, buffer, &count);
+    }
+    else
+    {
+        initDirIterator(&it, dirFd, buffer, DIRENT_BUFFER_SIZE);
+    }
+    while (!atomic_load(&query->worker->ctx->stopped))
+    {
+        if (options->sorted)
+        {
+            if (next == count)
+            {
+                break;
+            }
+            name = entries[next].name;
+            type = entries[next++].type;
+        }
+        else if ((result = nextDirEntry(&it, &name, &type)) != 1)
+        {
+            break;
+        }
+        int length = relDir[0] != '\0' ? snprintf(relPath, sizeof(relPath), "%s/%s", relDir, name)
+                                       : snprintf(relPath, sizeof(relPath), "%s", name);
+        if (length >= (int)sizeof(relPath))
+        {
+            fprintf(stderr, "search: %s/%s: path too long\n", relDir, name);
+            continue;
+        }
+        if (snprintf(filePath, sizeof(filePath), "%s/%s", query->root, relPath) >= (int)sizeof(filePath))
+        {
+            fprintf(stderr, "search: %s/%s: path too long\n", query->root, relPath);
+            continue;
+        }
+
+        if (type == DT_REG && matchesFileType(options->fileFilter, name))
+        {
+            if (scope != NULL && isIgnored(scope, filePath, name, 0))
+            {
+                continue;
+            }
+            uint32_t id = findIndexedFile(query->index, relPath);
+            if (id != UINT32_MAX && !query->isCandidate[id])
+            {
+                struct stat st;
+                if (fstatat(dirFd, name, &st, AT_SYMLINK_NOFOLLOW) == -1 ||
+                    sameIndexedFile(&query->index->files[id], &st))
+                {
+                    continue;
+                }
+            }
+            int fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC);
+            if (fd == -1)
+            {
+                perror(filePath);
+                continue;
+            }
+            searchFilesKaragulHelper(query->worker, fd, filePath);
+        }
+        else if (options->recursive && type == DT_DIR)
+        {
+            if (scope != NULL && isIgnored(scope, filePath, name, 1))
+            {
+                continue;
+            }
+            int childFd = openat(dirFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (childFd == -1)
+            {
+                perror("opendir");
+                continue;
+            }
+            searchIndexedDirectory(query, childFd, relPath, scope);
+            close(childFd);
+        }
+    }
+    if (result == -1)
+    {
+        perror("getdents64");
+    }
+    freeSortedEntries(entries, count);
+    releaseIgnoreScope(scope);
+    free(buffer);
+}
+
+// search --indexed PATTERN: uses the index of the current directory; with
+// several patterns a file is a candidate if it may contain any of them
+int indexedSearch(struct searchOptions *options)
+{
+    struct trigramIndex index;
+    struct searchContext ctx;
+    char root[MAX_FILE_NAME_SIZE];
+    int matched = -1;
+
+    if (getcwd(root, sizeof(root)) == NULL)
+    {
+        perror("getcwd");
+        return -1;
+    }
+    if (openTrigramIndex(root, &index) == -1)
+    {
+        fprintf(stderr, "search: no index in %s, run search --index build DIR first\n", root);
+        return -1;
+    }
+    if (hashIndexPaths(&index) == -1)
+    {
+        closeTrigramIndex(&index);
+        return -1;
+    }
+
+    uint32_t fileCount = index.header->fileCount;
+    unsigned char *isCandidate = calloc(fileCount ? fileCount : 1, 1);
+    if (isCandidate == NULL)
+    {
+        perror("calloc");
+        closeTrigramIndex(&index);
+        return -1;
+    }
+    int rootFd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd == -1)
+    {
+        perror("opendir");
+        free(isCandidate);
+        closeTrigramIndex(&index);
+        return -1;
+    }
+    fflush(stdout);
+    if (initSearchContext(&ctx, options, 1) == 0)
+    {
+        if (ctx.regex != NULL)
+        {
+            // Only the regex's required literal can narrow the candidates down
+            markIndexCandidates(&index, ctx.regex->literal, isCandidate);
+        }
+        for (int i = 0; ctx.regex == NULL && i < options->patternCount; i++)
+        {
+            markIndexCandidates(&index, options->patterns[i], isCandidate);
+        }
+
+        struct indexQuery query = {.index = &index, .isCandidate = isCandidate, .worker = &ctx.workers[0], .root = root};
+        searchIndexedDirectory(&query, rootFd, "", NULL);
+        matched = atomic_load(&ctx.matched);
+        destroySearchContext(&ctx);
+    }
+
+    close(rootFd);
+    free(isCandidate);
+    closeTrigramIndex(&index);
+    return matched;
+}
+
+// 100, 64K, 10M, 2G
+off_t parseSize(const char *text)
+{
+    char *end;
+    long long size = strtoll(text, &end, 10);
+
+    switch (toupper((unsigned char)*end))
+    {
+    case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+        size *= 1024;
+        end++;
+        break;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+// search [-r] [-j N] [--sorted] [--indexed] [--no-ignore] [--no-cache] [--max-filesize SIZE]
+//        [-t TYPE]... [--type-add NAME:EXT,EXT] <searchedString>
+// search [-r] ... -e <pattern> [-e <pattern> ...] | -F <patternFile>
+// search [-r] ... -E <regex>
+// search [-r] ... [-l | -c | -q] [-m N] [--io-uring] ...
+// search --index build <directory>
+// Returns 0 if something matched, 1 if nothing did and 2 on errors
+int searchCommand(char **args)
+{
+    struct searchOptions options;
+    struct suffixTable typeFilter;
+    struct fileType **types = NULL;
+    char **typeNames = NULL;
+    int typeCount = 0;
+    int indexed = 0;
+    int explicitPatterns = 0;
+    int usage = 0;
+
+    memset(&options, 0, sizeof(options));
+    options.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    options.fileFilter = &defaultFilter;
+
+    if (args[1] != NULL && strcmp(args[1], "--index") == 0)
+    {
+        if (args[2] != NULL && strcmp(args[2], "build") == 0 && args[3] != NULL)
+        {
+            buildTrigramIndex(args[3]);
+            return 0;
+        }
+        printf("Usage: search --index build <directory>\n");
+        return 2;
+    }
+
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (strcmp(args[i], "-r") == 0)
+        {
+            options.recursive = 1;
+        }
+        else if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL)
+        {
+            options.jobs = atoi(args[++i]);
+        }
+        else if (strcmp(args[i], "--sorted") == 0)
+        {
+            options.sorted = 1;
+        }
+        else if (strcmp(args[i], "--no-ignore") == 0)
+        {
+            options.noIgnore = 1;
+        }
+        else if (strcmp(args[i], "-l") == 0)
+        {
+            options.outputMode = OUTPUT_FILES;
+        }
+        else if (strcmp(args[i], "-c") == 0)
+        {
+            options.outputMode = OUTPUT_COUNT;
+        }
+        else if (strcmp(args[i], "-q") == 0)
+        {
+            options.outputMode = OUTPUT_QUIET;
+        }
+        else if (strcmp(args[i], "-m") == 0 && args[i + 1] != NULL)
+        {
+            char *end;
+            options.maxCount = strtoul(args[++i], &end, 10);
+            if (*end != '\0' || options.maxCount == 0)
+            {
+                usage = 1;
+                break;
+            }
+        }
+        else if (strcmp(args[i], "--io-uring") == 0)
+        {
+            options.ioUring = 1;
+        }
+        else if (strcmp(args[i], "--no-cache") == 0)
+        {
+            options.noCache = 1;
+        }
+        else if (strcmp(args[i], "--max-filesize") == 0 && args[i + 1] != NULL)
+        {
+            if ((options.maxFileSize = parseSize(args[++i])) <= 0)
+            {
+                usage = 1;
+                break;
+            }
+        }
+        else if (strcmp(args[i], "--indexed") == 0)
+        {
+            indexed = 1;
+        }
+        else if (strcmp(args[i], "-t") == 0 && args[i + 1] != NULL)
+        {
+            // Resolved after parsing so --type-add may come later on the line
+            typeNames = realloc(typeNames, (typeCount + 1) * sizeof(char *));
+            if (typeNames == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            typeNames[typeCount++] = args[++i];
+        }
+        else if (strcmp(args[i], "--type-add") == 0 && args[i + 1] != NULL)
+        {
+            // Registered for the rest of the session
+            char *colon = strchr(args[++i], ':');
+            if (colon == NULL || colon == args[i])
+            {
+                usage = 1;
+                break;
+            }
+            *colon = '\0';
+            addFileTypeExtensions(args[i], colon + 1);
+            if (strcmp(args[i], "c") == 0)
+            {
+                struct fileType *defaultType = findFileType("c");
+                freeSuffixTable(&defaultFilter);
+                compileSuffixTable(&defaultFilter, &defaultType, 1);
+            }
+            *colon = ':';
+        }
+        else if (strcmp(args[i], "-e") == 0 && args[i + 1] != NULL)
+        {
+            addSearchPattern(&options, args[++i], 0);
+            explicitPatterns = 1;
+        }
+        else if (strcmp(args[i], "-E") == 0 && args[i + 1] != NULL)
+        {
+            addSearchPattern(&options, args[++i], 0);
+            options.useRegex = 1;
+            explicitPatterns = 1;
+        }
+        else if (strcmp(args[i], "-F") == 0 && args[i + 1] != NULL)
+        {
+            if (readPatternFile(args[++i], &options) == -1)
+            {
+                freeSearchPatterns(&options);
+                return 2;
+            }
+            explicitPatterns = 1;
+        }
+        else if (!explicitPatterns && options.patternCount == 0)
+        {
+            addSearchPattern(&options, args[i], 0);
+        }
+        else
+        {
+            usage = 1;
+            break;
+        }
+    }
+
+    if (usage || options.patternCount == 0 || (options.useRegex && options.patternCount > 1))
+    {
+        printf("Usage: search [-r] [-j N] [--sorted] [--indexed] [--no-ignore] [--no-cache] [--max-filesize SIZE]\n");
+        printf("              [-t TYPE]... [--type-add NAME:EXT,EXT] [-l | -c | -q] [-m N] [--io-uring]\n");
+        printf("              <searchedString> | -e <pattern>... | -F <patternFile> | -E <regex>\n");
+        printf("       search --index build <directory>\n");
+        free(typeNames);
+        freeSearchPatterns(&options);
+        return 2;
+    }
+    options.searchString = options.patterns[0];
+
+    if (typeCount > 0)
+    {
+        types = malloc(typeCount * sizeof(struct fileType *));
+        if (types == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < typeCount; i++)
+        {
+            if ((types[i] = findFileType(typeNames[i])) == NULL)
+            {
+                fprintf(stderr, "search: unknown file type '%s'\n", typeNames[i]);
+                usage = -1;
+            }
+        }
+        if (usage == -1 || compileSuffixTable(&typeFilter, types, typeCount) == -1)
+        {
+            free(types);
+            free(typeNames);
+            freeSearchPatterns(&options);
+            return 2;
+        }
+        options.fileFilter = &typeFilter;
+    }
+
+    int found;
+    if (indexed)
+    {
+        found = indexedSearch(&options);
+    }
+    else
+    {
+        found = searchFilesKaragul(&options);
+    }
+    if (typeCount > 0)
+    {
+        freeSuffixTable(&typeFilter);
+    }
+    free(types);
+    free(typeNames);
+    freeSearchPatterns(&options);
+    return found == 1 ? 0 : found == 0 ? 1 : 2;
+}
+
+// Job table: every job the shell starts is recorded until it is over. Jobs
+// are found by id through jobTable (slot id - 1) and by any of their pids
+// through a chained hash, so reaping a child costs one bucket walk. SIGCHLD
+// stays blocked and is read from a signalfd, which the input reader polls
+// next to stdin so children are reaped as they exit, not at the next command.
+void initJobTable()
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    childSignalFd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (childSignalFd == -1)
+    {
+        // Still correct, reaping just waits for the next prompt
+        perror("signalfd");
+    }
+
+    // Children start with nothing blocked
+    sigemptyset(&mask);
+    posix_spawnattr_init(&spawnAttr);
+    posix_spawnattr_setsigmask(&spawnAttr, &mask);
+    posix_spawnattr_setflags(&spawnAttr, POSIX_SPAWN_SETSIGMASK);
+}
+
+// For fork(): undoes the shell's blocked SIGCHLD before exec
+void resetChildSignals()
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+}
+
+// The command line as typed, without the newline and a trailing &
+char *copyJobCommand()
+{
+    size_t length = commandLength;
+
+    while (length > 0 && strchr(" \t\r\n&", commandText[length - 1]) != NULL)
+    {
+        length--;
+    }
+    return strndup(commandText != NULL ? commandText : "", length);
+}
+
+struct job *addJob(pid_t *pids, int count, int background)
+{
+    struct job *job = calloc(1, sizeof(struct job));
+
+    if (job == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    if (jobHighest == jobCapacity)
+    {
+        jobCapacity = jobCapacity ? jobCapacity * 2 : 16;
+        jobTable = realloc(jobTable, jobCapacity * sizeof(struct job *));
+        if (jobTable == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // Ids grow past the highest one in use and start over once all are gone
+    job->id = ++jobHighest;
+    jobTable[job->id - 1] = job;
+    jobCount++;
+
+    job->processes = calloc(count, sizeof(struct jobProcess));
+    if (job->processes == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    job->processCount = count;
+    job->running = count;
+    job->background = background;
+    job->pgid = pids[0];
+    job->command = copyJobCommand();
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+    for (int i = 0; i < count; i++)
+    {
+        struct jobProcess *process = &job->processes[i];
+        process->pid = pids[i];
+        process->job = job;
+        process->next = jobPids[pids[i] % JOB_PID_BUCKETS];
+        jobPids[pids[i] % JOB_PID_BUCKETS] = process;
+    }
+    return job;
+}
+
+struct jobProcess *findJobProcess(pid_t pid)
+{
+    for (struct jobProcess *process = jobPids[pid % JOB_PID_BUCKETS]; process != NULL; process = process->next)
+    {
+        if (process->pid == pid)
+        {
+            return process;
+        }
+    }
+    return NULL;
+}
+
+struct job *findJob(int id)
+{
+    return id >= 1 && id <= jobHighest ? jobTable[id - 1] : NULL;
+}
+
+void removeJob(struct job *job)
+{
+    for (int i = 0; i < job->processCount; i++)
+    {
+        struct jobProcess **link = &jobPids[job->processes[i].pid % JOB_PID_BUCKETS];
+        while (*link != &job->processes[i])
+        {
+            link = &(*link)->next;
+        }
+        *link = job->processes[i].next;
+    }
+    jobTable[job->id - 1] = NULL;
+    while (jobHighest > 0 && jobTable[jobHighest - 1] == NULL)
+    {
+        jobHighest--;
+    }
+    jobCount--;
+    free(job->processes);
+    free(job->command);
+    free(job);
+}
+
+// Records a wait status; the job's status is that of its last process
+void updateJobProcess(struct jobProcess *process, int status)
+{
+    struct job *job = process->job;
+
+    if (WIFSTOPPED(status) || WIFCONTINUED(status))
+    {
+        int stopped = WIFSTOPPED(status);
+        if (process->stopped != stopped)
+        {
+            process->stopped = stopped;
+            job->stopped += stopped ? 1 : -1;
+            job->notified = 0;
+        }
+        return;
+    }
+    if (process->stopped)
+    {
+        process->stopped = 0;
+        job->stopped--;
+    }
+    process->status = status;
+    process->done = 1;
+    if (process == &job->processes[job->processCount - 1])
+    {
+        job->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    if (--job->running == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &job->finished);
+    }
+}
+
+// SIGHUP or SIGTERM, blocked while history is kept: the pending lines are
+// written, then the shell dies of the signal as it would have unblocked
+void hangUpShell(int signo)
+{
+    sigset_t mask;
+
+    flushHistory();
+    signal(signo, SIG_DFL);
+    sigemptyset(&mask);
+    sigaddset(&mask, signo);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    raise(signo);
+}
+
+// Collects every child that has exited, stopped or continued; safe to call at any time
+void reapChildren()
+{
+    struct signalfd_siginfo info[8];
+    ssize_t n;
+    pid_t pid;
+    int status;
+
+    if (childSignalFd != -1)
+    {
+        while ((n = read(childSignalFd, info, sizeof(info))) > 0)
+        {
+            for (size_t i = 0; i < n / sizeof(info[0]); i++)
+            {
+                if (info[i].ssi_signo != SIGCHLD)
+                {
+                    hangUpShell(info[i].ssi_signo);
+                }
+            }
+        }
+    }
+    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0)
+    {
+        struct jobProcess *process = findJobProcess(pid);
+        if (process != NULL)
+        {
+            updateJobProcess(process, status);
+        }
+    }
+}
+
+double jobSeconds(const struct job *job)
+{
+    return (job->finished.tv_sec - job->started.tv_sec) + (job->finished.tv_nsec - job->started.tv_nsec) / 1e9;
+}
+
+// Reports finished background jobs (interactively) and drops them from the
+// table; jobs stopped by a signal are reported once and kept
+void notifyJobs()
+{
+    for (int id = 1; id <= jobHighest; id++)
+    {
+        struct job *job = jobTable[id - 1];
+        if (job != NULL && jobIsStopped(job) && !job->notified)
+        {
+            if (interactive)
+            {
+                printf("[%d]+  Stopped                 %s\n", job->id, job->command);
+            }
+            job->notified = 1;
+        }
+        if (job == NULL || job->running > 0)
+        {
+            continue;
+        }
+        if (interactive)
+        {
+            char state[32];
+            if (job->status == 0)
+            {
+                snprintf(state, sizeof(state), "Done");
+            }
+            else
+            {
+                snprintf(state, sizeof(state), "Exit %d", job->status);
+            }
+            printf("[%d] %-10s %s (%.2fs)\n", job->id, state, job->command, jobSeconds(job));
+        }
+        removeJob(job);
+    }
+}
+
+// Job control, for interactive shells only: the shell sits in its own
+// process group and ignores the terminal's job signals; every job gets a
+// group of its own, and the terminal is handed to a foreground job's group
+// so Ctrl+C and Ctrl+Z reach only that job.
+void initJobControl()
+{
+    if (!interactive || !isatty(STDIN_FILENO))
+    {
+        return;
+    }
+    shellTerminal = STDIN_FILENO;
+
+    // Wait to be put in the foreground if started in the background
+    while (tcgetpgrp(shellTerminal) != (shellPgid = getpgrp()))
+    {
+        kill(-shellPgid, SIGTTIN);
+    }
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    shellPgid = getpid();
+    if (setpgid(shellPgid, shellPgid) == -1 && errno != EPERM)
+    {
+        perror("setpgid");
+        return;
+    }
+    shellPgid = getpgrp();
+    tcsetpgrp(shellTerminal, shellPgid);
+    tcgetattr(shellTerminal, &shellModes);
+    jobControl = 1;
+
+    // Children get the default dispositions back and a group of their own
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGQUIT);
+    sigaddset(&defaults, SIGTSTP);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigdefault(&spawnAttr, &defaults);
+    posix_spawnattr_setflags(&spawnAttr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETPGROUP);
+}
+
+// Puts the next spawned process in group pgid, 0 for a new group. A
+// foreground child takes the terminal itself, before it can read from it.
+void setSpawnGroup(posix_spawn_file_actions_t *actions, pid_t pgid, int foreground)
+{
+    if (jobControl)
+    {
+        posix_spawnattr_setpgroup(&spawnAttr, pgid);
+        if (foreground)
+        {
+            posix_spawn_file_actions_addtcsetpgrp_np(actions, shellTerminal);
+        }
+    }
+}
+
+// The fork() counterpart of setSpawnGroup and the spawn attributes; the
+// parent calls setpgid too, whichever runs first wins the race
+void enterJobGroup(pid_t pgid, int foreground)
+{
+    if (jobControl)
+    {
+        setpgid(0, pgid);
+        if (foreground)
+        {
+            tcsetpgrp(shellTerminal, getpgrp());
+        }
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+    }
+    resetChildSignals();
+}
+
+int jobIsStopped(const struct job *job)
+{
+    return job->running > 0 && job->stopped == job->running;
+}
+
+// Gives the terminal to job and waits until it exits or stops. Other jobs'
+// children reaped on the way are recorded in their own jobs.
+void waitForegroundJob(struct job *job)
+{
+    pid_t pid;
+    int status;
+
+    job->background = 0;
+    if (jobControl)
+    {
+        tcsetpgrp(shellTerminal, job->pgid);
+    }
+    while (job->running > 0 && !jobIsStopped(job))
+    {
+        pid = waitpid(-1, &status, WUNTRACED);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        struct jobProcess *process = findJobProcess(pid);
+        if (process != NULL)
+        {
+            updateJobProcess(process, status);
+        }
+    }
+    if (jobControl)
+    {
+        tcsetpgrp(shellTerminal, shellPgid);
+        if (jobIsStopped(job))
+        {
+            tcgetattr(shellTerminal, &job->modes);
+            job->hasModes = 1;
+        }
+        tcsetattr(shellTerminal, TCSADRAIN, &shellModes);
+    }
+
+    if (jobIsStopped(job))
+    {
+        printf("\n[%d]+  Stopped                 %s\n", job->id, job->command);
+        job->notified = 1;
+        lastStatus = 128 + SIGTSTP;
+        return;
+    }
+    lastStatus = job->status;
+    removeJob(job);
+}
+
+// %n, %%, %+ (the newest job), %- (the one before it), or a bare n
+struct job *parseJobSpec(const char *spec, const char *builtin)
+{
+    struct job *job = NULL;
+
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0)
+    {
+        job = findJob(jobHighest);
+    }
+    else if (strcmp(spec, "%-") == 0)
+    {
+        for (int id = jobHighest - 1; id >= 1 && job == NULL; id--)
+        {
+            job = findJob(id);
+        }
+    }
+    else
+    {
+        job = findJob(atoi(spec[0] == '%' ? spec + 1 : spec));
+    }
+    if (job == NULL)
+    {
+        fprintf(stderr, "myshell: %s: %s: no such job\n", builtin, spec != NULL ? spec : "current");
+    }
+    return job;
+}
+
+// To the job's group, or to each of its processes when they share the shell's
+void signalJob(struct job *job, int signo)
+{
+    if (jobControl)
+    {
+        kill(-job->pgid, signo);
+        return;
+    }
+    for (int i = 0; i < job->processCount; i++)
+    {
+        if (!job->processes[i].done)
+        {
+            kill(job->processes[i].pid, signo);
+        }
+    }
+}
+
+void continueJob(struct job *job)
+{
+    for (int i = 0; i < job->processCount; i++)
+    {
+        job->processes[i].stopped = 0;
+    }
+    job->stopped = 0;
+    job->notified = 0;
+    signalJob(job, SIGCONT);
+}
+
+// jobs: [id]  state  command
+int jobsCommand(char **args)
+{
+    (void)args;
+    reapChildren();
+    for (int id = 1; id <= jobHighest; id++)
+    {
+        struct job *job = jobTable[id - 1];
+        if (job == NULL)
+        {
+            continue;
+        }
+        const char *state = job->running == 0 ? "Done" : jobIsStopped(job) ? "Stopped" : "Running";
+        printf("[%d]%c  %-24s%s%s\n", job->id, id == jobHighest ? '+' : ' ', state, job->command,
+               job->running > 0 && !jobIsStopped(job) ? " &" : "");
+        if (job->running == 0)
+        {
+            removeJob(job);
+        }
+    }
+    return 0;
+}
+
+// fg [%n]: resumes a job in the foreground and waits for it
+int fgCommand(char **args)
+{
+    if (!jobControl)
+    {
+        fprintf(stderr, "myshell: fg: no job control\n");
+        return 1;
+    }
+    struct job *job = parseJobSpec(args[1], "fg");
+    if (job == NULL)
+    {
+        return 1;
+    }
+    printf("%s\n", job->command);
+    fflush(stdout);
+    if (job->hasModes)
+    {
+        tcsetattr(shellTerminal, TCSADRAIN, &job->modes);
+    }
+    tcsetpgrp(shellTerminal, job->pgid);
+    continueJob(job);
+    waitForegroundJob(job);
+    return lastStatus;
+}
+
+// bg [%n]: resumes a stopped job in the background
+int bgCommand(char **args)
+{
+    if (!jobControl)
+    {
+        fprintf(stderr, "myshell: bg: no job control\n");
+        return 1;
+    }
+    struct job *job = parseJobSpec(args[1], "bg");
+    if (job == NULL)
+    {
+        return 1;
+    }
+    if (!jobIsStopped(job))
+    {
+        fprintf(stderr, "myshell: bg: job %d already in background\n", job->id);
+        return 0;
+    }
+    job->background = 1;
+    continueJob(job);
+    printf("[%d]+ %s &\n", job->id, job->command);
+    return 0;
+}
+
+// wait            -> wait for every running job, status 0
+// wait %n|pid...  -> wait for those jobs, status of the last one; 127 when
+//                    it names no job
+// wait -n [...]   -> wait for whichever running (listed) job finishes next
+int waitCommand(char **args)
+{
+    int next = args[1] != NULL && strcmp(args[1], "-n") == 0;
+    char **specs = &args[1 + next];
+    int specCount = 0;
+    int found = 0;
+    int status = 0;
+    pid_t pid;
+    int childStatus;
+
+    // Jobs already over when wait starts count as finished right away
+    reapChildren();
+
+    // Resolve the specs once: job ids stay put while a job is in the table,
+    // and a pid stops naming its job once the job is removed
+    while (specs[specCount] != NULL)
+    {
+        specCount++;
+    }
+    int *ids = malloc((specCount + 1) * sizeof(int));
+    int *statuses = malloc((specCount + 1) * sizeof(int));
+    if (ids == NULL || statuses == NULL)
+    {
+        perror("malloc");
+        free(ids);
+        free(statuses);
+        return 1;
+    }
+    for (int i = 0; i < specCount; i++)
+    {
+        struct job *job = NULL;
+        if (specs[i][0] == '%')
+        {
+            job = parseJobSpec(specs[i], "wait");
+        }
+        else
+        {
+            struct jobProcess *process = findJobProcess(atoi(specs[i]));
+            if (process != NULL)
+            {
+                job = process->job;
+            }
+            else
+            {
+                fprintf(stderr, "myshell: wait: %s: no such job\n", specs[i]);
+            }
+        }
+        ids[i] = job != NULL ? job->id : 0;
+        statuses[i] = 127;
+        found += job != NULL;
+    }
+    if (specCount > 0 && found == 0)
+    {
+        free(ids);
+        free(statuses);
+        return 127;
+    }
+
+    while (1)
+    {
+        int waiting = 0;
+
+        for (int id = 1; id <= jobHighest; id++)
+        {
+            struct job *job = jobTable[id - 1];
+            if (job == NULL)
+            {
+                continue;
+            }
+            int wanted = specCount == 0;
+            for (int i = 0; i < specCount; i++)
+            {
+                if (ids[i] == id)
+                {
+                    wanted = 1;
+                }
+            }
+            if (!wanted)
+            {
+                continue;
+            }
+            if (job->running == 0)
+            {
+                status = specCount == 0 ? 0 : job->status;
+                for (int i = 0; i < specCount; i++)
+                {
+                    if (ids[i] == id)
+                    {
+                        statuses[i] = status;
+                        ids[i] = 0;
+                    }
+                }
+                removeJob(job);
+                if (next)
+                {
+                    free(ids);
+                    free(statuses);
+                    return status;
+                }
+            }
+            else if (!jobIsStopped(job))
+            {
+                waiting = 1;
+            }
+        }
+        if (!waiting)
+        {
+            break;
+        }
+
+        pid = waitpid(-1, &childStatus, WUNTRACED);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        struct jobProcess *process = findJobProcess(pid);
+        if (process != NULL)
+        {
+            updateJobProcess(process, childStatus);
+        }
+    }
+    if (specCount > 0 && !next)
+    {
+        status = statuses[specCount - 1];
+    }
+    free(ids);
+    free(statuses);
+    return status;
+}
+
+// Items for parallel and batchrun: one per line of fd, read to EOF. The
+// pointers point into one buffer, returned through storage.
+char **readInputItems(int fd, int *count, char **storage)
+{
+    size_t length = 0;
+    size_t capacity = INPUT_CHUNK_SIZE;
+    char *data = malloc(capacity + 1);
+    ssize_t n;
+
+    if (data == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    while ((n = read(fd, data + length, capacity - length)) != 0)
+    {
+        if (n == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("read");
+            break;
+        }
+        length += n;
+        if (length == capacity)
+        {
+            capacity *= 2;
+            data = realloc(data, capacity + 1);
+            if (data == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    data[length] = '\0';
+
+    int itemCapacity = 64;
+    char **items = malloc(itemCapacity * sizeof(char *));
+    *count = 0;
+    for (char *line = data; line < data + length;)
+    {
+        char *end = memchr(line, '\n', data + length - line);
+        if (end == NULL)
+        {
+            end = data + length;
+        }
+        *end = '\0';
+        if (end > line && end[-1] == '\r')
+        {
+            end[-1] = '\0';
+        }
+        if (*line != '\0')
+        {
+            if (*count == itemCapacity)
+            {
+                itemCapacity *= 2;
+                items = realloc(items, itemCapacity * sizeof(char *));
+            }
+            if (items == NULL)
+            {
+                perror("realloc");
+                exit(EXIT_FAILURE);
+            }
+            items[(*count)++] = line;
+        }
+        line = end + 1;
+    }
+    *storage = data;
+    return items;
+}
+
+// CMD with every {} replaced by item, or item appended when there is no {}
+char **buildParallelArgs(char **command, int commandCount, const char *item)
+{
+    char **jobArgs = malloc((commandCount + 2) * sizeof(char *));
+    int placed = 0;
+    size_t itemLength = strlen(item);
+
+    if (jobArgs == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < commandCount; i++)
+    {
+        const char *word = command[i];
+        size_t length = strlen(word);
+        int holes = 0;
+
+        for (const char *hole = strstr(word, "{}"); hole != NULL; hole = strstr(hole + 2, "{}"))
+        {
+            holes++;
+        }
+        char *copy = malloc(length + holes * itemLength + 1);
+        char *out = copy;
+        if (copy == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        for (const char *hole; (hole = strstr(word, "{}")) != NULL; word = hole + 2)
+        {
+            memcpy(out, word, hole - word);
+            out += hole - word;
+            memcpy(out, item, itemLength);
+            out += itemLength;
+        }
+        strcpy(out, word);
+        jobArgs[i] = copy;
+        placed += holes;
+    }
+    jobArgs[commandCount] = placed ? NULL : strdup(item);
+    jobArgs[commandCount + 1] = NULL;
+    return jobArgs;
+}
+
+void freeParallelArgs(char **jobArgs)
+{
+    for (int i = 0; jobArgs[i] != NULL; i++)
+    {
+        free(jobArgs[i]);
+    }
+    free(jobArgs);
+}
+
+// Copies a -k job's buffered output to the shell's stdout and closes it
+void flushParallelOutput(int fd)
+{
+    char buffer[65536];
+    ssize_t n;
+
+    lseek(fd, 0, SEEK_SET);
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t written = 0, w; written < n; written += w)
+        {
+            w = write(STDOUT_FILENO, buffer + written, n - written);
+            if (w == -1)
+            {
+                if (errno != EINTR)
+                {
+                    close(fd);
+                    return;
+                }
+                w = 0;
+            }
+        }
+    }
+    close(fd);
+}
+
+// Waits for one child. Children of the shell's own jobs are recorded in the
+// job table; a child of ours that stops is continued, since parallel runs in
+// the shell and cannot be suspended as a whole. Returns -1 when none are left.
+pid_t waitSchedulerChild(int *status)
+{
+    pid_t pid;
+
+    while (1)
+    {
+        pid = waitpid(-1, status, WUNTRACED);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        struct jobProcess *process = findJobProcess(pid);
+        if (process != NULL)
+        {
+            updateJobProcess(process, *status);
+            continue;
+        }
+        if (WIFSTOPPED(*status))
+        {
+            kill(pid, SIGCONT);
+            continue;
+        }
+        return pid;
+    }
+}
+
+// parallel [-j N] [-k] CMD [ARG...] [::: ITEM...]: runs CMD once per item,
+// with at most N running at a time; a slot is refilled as soon as its child
+// exits. Without ::: the items are the lines of stdin. {} in CMD stands for
+// the item, otherwise it is appended. -k prints each job's output whole and
+// in item order, buffered in a memfd until the jobs before it are done.
+// Failed jobs are reported on stderr; the status is their count (at most
+// 101), or 130 when Ctrl+C stopped the run.
+int parallelCommand(char **args)
+{
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int keepOrder = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-'; i++)
+    {
+        if (strcmp(args[i], "-j") == 0 && args[i + 1] != NULL)
+        {
+            jobs = atoi(args[++i]);
+        }
+        else if (strcmp(args[i], "-k") == 0)
+        {
+            keepOrder = 1;
+        }
+        else
+        {
+            break;
+        }
+    }
+    char **command = &args[i];
+    int commandCount = 0;
+    while (command[commandCount] != NULL && strcmp(command[commandCount], ":::") != 0)
+    {
+        commandCount++;
+    }
+    if (commandCount == 0 || jobs < 1)
+    {
+        fprintf(stderr, "Usage: parallel [-j N] [-k] CMD [ARG...] [::: ITEM...]\n");
+        return 2;
+    }
+
+    char **items;
+    char *storage = NULL;
+    int itemCount = 0;
+    if (command[commandCount] != NULL)
+    {
+        items = &command[commandCount + 1];
+        while (items[itemCount] != NULL)
+        {
+            itemCount++;
+        }
+    }
+    else
+    {
+        items = readInputItems(STDIN_FILENO, &itemCount, &storage);
+    }
+    // No more slots than items, whatever -j asked for
+    if (jobs > itemCount)
+    {
+        jobs = itemCount > 0 ? itemCount : 1;
+    }
+
+    pid_t *slots = malloc(jobs * sizeof(pid_t));
+    int *slotItems = malloc(jobs * sizeof(int));
+    int *outputs = malloc((itemCount + 1) * sizeof(int));
+    char *finished = calloc(itemCount + 1, 1);
+    if (slots == NULL || slotItems == NULL || outputs == NULL || finished == NULL)
+    {
+        perror("malloc");
+        free(slots);
+        free(slotItems);
+        free(outputs);
+        free(finished);
+        if (storage != NULL)
+        {
+            free(items);
+            free(storage);
+        }
+        return 2;
+    }
+    for (long slot = 0; slot < jobs; slot++)
+    {
+        slots[slot] = 0;
+    }
+
+    int next = 0;
+    int printed = 0;
+    int running = 0;
+    int failed = 0;
+    int interrupted = 0;
+    fflush(stdout);
+
+    while (running > 0 || (next < itemCount && !interrupted))
+    {
+        // Fill every free slot
+        for (long slot = 0; slot < jobs && next < itemCount && !interrupted; slot++)
+        {
+            if (slots[slot] != 0)
+            {
+                continue;
+            }
+            int item = next++;
+            outputs[item] = -1;
+            if (keepOrder && (outputs[item] = memfd_create("parallel", MFD_CLOEXEC)) == -1)
+            {
+                perror("memfd_create");
+            }
+
+            char **jobArgs = buildParallelArgs(command, commandCount, items[item]);
+            pid_t pid;
+            // Children stay in the shell's group, which keeps the terminal
+            int started = startStage(jobArgs, -1, outputs[item], shellPgid, 0, &pid);
+            freeParallelArgs(jobArgs);
+            if (started == -1)
+            {
+                fprintf(stderr, "parallel: %s: could not start\n", items[item]);
+                failed++;
+                finished[item] = 1;
+                slot--; // the slot is still free
+                continue;
+            }
+            slots[slot] = pid;
+            slotItems[slot] = item;
+            running++;
+        }
+
+        // Print whatever is complete, in order
+        while (keepOrder && printed < next && finished[printed])
+        {
+            if (outputs[printed] != -1)
+            {
+                flushParallelOutput(outputs[printed]);
+            }
+            printed++;
+        }
+        if (running == 0)
+        {
+            continue;
+        }
+
+        int status;
+        pid_t pid = waitSchedulerChild(&status);
+        if (pid == -1)
+        {
+            break;
+        }
+        for (long slot = 0; slot < jobs; slot++)
+        {
+            if (slots[slot] != pid)
+            {
+                continue;
+            }
+            int item = slotItems[slot];
+            slots[slot] = 0;
+            running--;
+            finished[item] = 1;
+            if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+            {
+                interrupted = 1;
+            }
+            else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                fprintf(stderr, "parallel: %s: %s %d\n", items[item], WIFEXITED(status) ? "exit" : "signal",
+                        WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status));
+                failed++;
+            }
+            break;
+        }
+    }
+
+    // Output of jobs that finished out of order after an interrupt
+    for (; keepOrder && printed < next; printed++)
+    {
+        if (outputs[printed] != -1)
+        {
+            flushParallelOutput(outputs[printed]);
+        }
+    }
+
+    free(slots);
+    free(slotItems);
+    free(outputs);
+    free(finished);
+    if (storage != NULL)
+    {
+        free(items);
+        free(storage);
+    }
+    if (interrupted)
+    {
+        return 130;
+    }
+    return failed < 101 ? failed : 101;
+}
+
+// batchrun [-n N] [-P N] CMD [ARG...]: reads items from stdin, one per line,
+// and runs CMD with as many of them appended as one exec takes: the
+// arguments and environment stay below ARG_MAX, and -n caps the count. Up
+// to -P invocations run at once (default 1). Nothing runs for empty input.
+// Status 123 when an invocation failed, 130 when Ctrl+C stopped the run.
+// Not called batch, which is the at(1) utility of the same name.
+int batchrunCommand(char **args)
+{
+    long maxItems = LONG_MAX;
+    long jobs = 1;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-'; i++)
+    {
+        if (strcmp(args[i], "-n") == 0 && args[i + 1] != NULL)
+        {
+            maxItems = atol(args[++i]);
+        }
+        else if (strcmp(args[i], "-P") == 0 && args[i + 1] != NULL)
+        {
+            jobs = atol(args[++i]);
+        }
+        else
+        {
+            break;
+        }
+    }
+    char **command = &args[i];
+    int commandCount = 0;
+    while (command[commandCount] != NULL)
+    {
+        commandCount++;
+    }
+    if (commandCount == 0 || maxItems < 1 || jobs < 1)
+    {
+        fprintf(stderr, "Usage: batchrun [-n N] [-P N] CMD [ARG...]\n");
+        return 2;
+    }
+
+    // What exec counts against ARG_MAX: every string with its NUL and its
+    // pointer, environment included; 2K is left for the kernel's own use
+    long budget = sysconf(_SC_ARG_MAX) - 2048;
+    for (char **env = environ; *env != NULL; env++)
+    {
+        budget -= strlen(*env) + 1 + sizeof(char *);
+    }
+    for (int k = 0; k < commandCount; k++)
+    {
+        budget -= strlen(command[k]) + 1 + sizeof(char *);
+    }
+    if (budget <= 0)
+    {
+        fprintf(stderr, "batchrun: environment and command leave no room for arguments\n");
+        return 2;
+    }
+
+    char *storage;
+    int itemCount;
+    char **items = readInputItems(STDIN_FILENO, &itemCount, &storage);
+    char **jobArgs = NULL;
+    int jobArgsCapacity = 0;
+    // Never more invocations than items
+    if (jobs > itemCount)
+    {
+        jobs = itemCount > 0 ? itemCount : 1;
+    }
+    pid_t *slots = calloc(jobs, sizeof(pid_t));
+    if (slots == NULL)
+    {
+        perror("calloc");
+        free(items);
+        free(storage);
+        return 2;
+    }
+
+    int next = 0;
+    int running = 0;
+    int failed = 0;
+    int interrupted = 0;
+    fflush(stdout);
+
+    while (running > 0 || (next < itemCount && !interrupted))
+    {
+        for (long slot = 0; slot < jobs && next < itemCount && !interrupted; slot++)
+        {
+            if (slots[slot] != 0)
+            {
+                continue;
+            }
+
+            // Pack items until the next one would not fit; one always goes
+            int count = 0;
+            long used = 0;
+            while (next + count < itemCount && count < maxItems)
+            {
+                long size = strlen(items[next + count]) + 1 + sizeof(char *);
+                if (count > 0 && used + size > budget)
+                {
+                    break;
+                }
+                used += size;
+                count++;
+            }
+            if (commandCount + count + 1 > jobArgsCapacity)
+            {
+                jobArgsCapacity = commandCount + count + 1;
+                jobArgs = realloc(jobArgs, jobArgsCapacity * sizeof(char *));
+                if (jobArgs == NULL)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            memcpy(jobArgs, command, commandCount * sizeof(char *));
+            memcpy(jobArgs + commandCount, items + next, count * sizeof(char *));
+            jobArgs[commandCount + count] = NULL;
+            next += count;
+
+            pid_t pid;
+            if (startStage(jobArgs, -1, -1, shellPgid, 0, &pid) == -1)
+            {
+                failed = 1;
+                interrupted = 1; // the rest would fail the same way
+                break;
+            }
+            slots[slot] = pid;
+            running++;
+        }
+        if (running == 0)
+        {
+            continue;
+        }
+
+        int status;
+        pid_t pid = waitSchedulerChild(&status);
+        if (pid == -1)
+        {
+            break;
+        }
+        for (long slot = 0; slot < jobs; slot++)
+        {
+            if (slots[slot] == pid)
+            {
+                slots[slot] = 0;
+                running--;
+                if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
+                {
+                    interrupted = 1;
+                }
+                else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+                {
+                    failed = 1;
+                }
+                break;
+            }
+        }
+    }
+
+    free(jobArgs);
+    free(slots);
+    free(items);
+    free(storage);
+    if (interrupted && !failed)
+    {
+        return 130;
+    }
+    return failed ? 123 : 0;
+}
+
+// Builtins run inside the shell: no process is created, and cd, export and
+// unset change the shell's own state. Redirections apply around the call.
+struct builtin builtins[] = {
+    {"exit", exitShell},
+    {"search", searchCommand},
+    {"bookmark", bookmarkCommand},
+    {"hash", hashCommand},
+    {"launch", launchCommand},
+    {"cd", cdCommand},
+    {"pwd", pwdCommand},
+    {"echo", echoCommand},
+    {"true", trueCommand},
+    {"false", falseCommand},
+    {"export", exportCommand},
+    {"unset", unsetCommand},
+    {"type", typeCommand},
+    {"jobs", jobsCommand},
+    {"fg", fgCommand},
+    {"bg", bgCommand},
+    {"wait", waitCommand},
+    {"parallel", parallelCommand},
+    {"batchrun", batchrunCommand},
+    {"history", historyCommand},
+};
+
+const struct builtin *findBuiltin(const char *name)
+{
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+        if (strcmp(builtins[i].name, name) == 0)
+        {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+int runBuiltin(const struct builtin *builtin, char **args)
+{
+    int status = 1;
+
+    if (redirection(args) == 0)
+    {
+        status = builtin->run(args);
+    }
+    // Whatever the builtin buffered belongs to the redirected descriptors
+    fflush(stdout);
+    fflush(stderr);
+    unredirection();
+    return status;
+}
+
+// cd [dir | -]: no argument goes to $HOME, - to $OLDPWD
+int cdCommand(char **args)
+{
+    char oldDir[MAX_FILE_NAME_SIZE];
+    char newDir[MAX_FILE_NAME_SIZE];
+    const char *target = args[1];
+
+    if (target == NULL)
+    {
+        target = getenv("HOME");
+        if (target == NULL)
+        {
+            fprintf(stderr, "myshell: cd: HOME not set\n");
+            return 1;
+        }
+    }
+    else if (strcmp(target, "-") == 0)
+    {
+        target = getenv("OLDPWD");
+        if (target == NULL)
+        {
+            fprintf(stderr, "myshell: cd: OLDPWD not set\n");
+            return 1;
+        }
+        printf("%s\n", target);
+    }
+
+    if (getcwd(oldDir, sizeof(oldDir)) == NULL)
+    {
+        oldDir[0] = '\0';
+    }
+    if (chdir(target) == -1)
+    {
+        fprintf(stderr, "myshell: cd: %s: %s\n", target, strerror(errno));
+        return 1;
+    }
+    if (oldDir[0] != '\0')
+    {
+        setenv("OLDPWD", oldDir, 1);
+    }
+    if (getcwd(newDir, sizeof(newDir)) != NULL)
+    {
+        setenv("PWD", newDir, 1);
+    }
+    return 0;
+}
+
+int pwdCommand(char **args)
+{
+    char dir[MAX_FILE_NAME_SIZE];
+
+    (void)args;
+    if (getcwd(dir, sizeof(dir)) == NULL)
+    {
+        perror("myshell: pwd");
+        return 1;
+    }
+    printf("%s\n", dir);
+    return 0;
+}
+
+// echo [-n] words...
+int echoCommand(char **args)
+{
+    int i = 1;
+    int newline = 1;
+
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0)
+    {
+        newline = 0;
+        i++;
+    }
+    for (int first = i; args[i] != NULL; i++)
+    {
+        if (i > first)
+        {
+            putchar(' ');
+        }
+        fputs(args[i], stdout);
+    }
+    if (newline)
+    {
+        putchar('\n');
+    }
+    return 0;
+}
+
+int trueCommand(char **args)
+{
+    (void)args;
+    return 0;
+}
+
+int falseCommand(char **args)
+{
+    (void)args;
+    return 1;
+}
+
+// export                -> list the environment
+// export NAME=VALUE...  -> set variables for this shell and its children
+// export NAME...        -> accepted; every variable is already exported
+int exportCommand(char **args)
+{
+    int status = 0;
+
+    if (args[1] == NULL)
+    {
+        for (char **env = environ; *env != NULL; env++)
+        {
+            printf("export %s\n", *env);
+        }
+        return 0;
+    }
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        char *equals = strchr(args[i], '=');
+        if (equals == args[i])
+        {
+            fprintf(stderr, "myshell: export: `%s': not a valid identifier\n", args[i]);
+            status = 1;
+            continue;
+        }
+        if (equals == NULL)
+        {
+            continue;
+        }
+        *equals = '\0';
+        if (setenv(args[i], equals + 1, 1) == -1)
+        {
+            fprintf(stderr, "myshell: export: `%s': %s\n", args[i], strerror(errno));
+            status = 1;
+        }
+        *equals = '=';
+    }
+    return status;
+}
+
+int unsetCommand(char **args)
+{
+    int status = 0;
+
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (unsetenv(args[i]) == -1)
+        {
+            fprintf(stderr, "myshell: unset: `%s': not a valid identifier\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// type name...: tells builtins from programs found on PATH
+int typeCommand(char **args)
+{
+    char fullPath[MAX_PATH_SIZE];
+    int status = 0;
+
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        if (findBuiltin(args[i]) != NULL)
+        {
+            printf("%s is a shell builtin\n", args[i]);
+        }
+        else if (findExecutable(args[i], fullPath))
+        {
+            printf("%s is %s\n", args[i], fullPath);
+        }
+        else
+        {
+            fprintf(stderr, "myshell: type: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+int isOperator(const char *word)
+{
+    return word == pipeOperator || word == inputOperator || word == outputOperator || word == appendOperator ||
+           word == errorOperator;
+}
+
+// The operator a word spells, for words stored without the lexer's pointers
+char *operatorFor(const char *word)
+{
+    char *operators[] = {pipeOperator, inputOperator, outputOperator, appendOperator, errorOperator};
+
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++)
+    {
+        if (strcmp(word, operators[i]) == 0)
+        {
+            return operators[i];
+        }
+    }
+    return NULL;
+}
+
+// Strips <, >, >> and 2> with their file names out of args and records them in spec
+int parseRedirections(char **args, struct redirectSpec *spec)
+{
+    int j = 0;
+
+    memset(spec, 0, sizeof(struct redirectSpec));
+
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        if (isOperator(args[i]) && args[i] != pipeOperator)
+        {
+            if (args[i + 1] == NULL || isOperator(args[i + 1]))
+            {
+                fprintf(stderr, "Error: Missing filename after %s\n", args[i]);
+                return -1;
+            }
+
+            if (args[i] == outputOperator)
+            {
+                spec->outFile = args[i + 1];
+                spec->outFlags = O_CREAT | O_TRUNC | O_WRONLY;
+            }
+            else if (args[i] == appendOperator)
+            {
+                spec->outFile = args[i + 1];
+                spec->outFlags = O_CREAT | O_APPEND | O_WRONLY;
+            }
+            else if (args[i] == errorOperator)
+            {
+                spec->errFile = args[i + 1];
+            }
+            else
+            {
+                spec->inFile = args[i + 1];
+            }
+            i++;
+            continue;
+        }
+        args[j++] = args[i];
+    }
+    args[j] = NULL;
+    return 0;
+}
+
+int redirectFile(const char *fileName, int flags, int targetFd)
+{
+    int fd = open(fileName, flags, 0666);
+
+    if (fd == -1)
+    {
+        perror("open");
+        return -1;
+    }
+    unRedirection = 1;
+    dup2(fd, targetFd);
+    close(fd);
+    return 0;
+}
+
+int applyRedirections(const struct redirectSpec *spec)
+{
+    if (spec->inFile != NULL && redirectFile(spec->inFile, O_RDONLY, STDIN_FILENO) == -1)
+    {
+        return -1;
+    }
+    if (spec->outFile != NULL && redirectFile(spec->outFile, spec->outFlags, STDOUT_FILENO) == -1)
+    {
+        return -1;
+    }
+    if (spec->errFile != NULL && redirectFile(spec->errFile, O_CREAT | O_TRUNC | O_WRONLY, STDERR_FILENO) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Applies the redirections to the shell's own descriptors; unredirection() undoes them
+int redirection(char **args)
+{
+    struct redirectSpec spec;
+
+    if (parseRedirections(args, &spec) == -1)
+    {
+        return -1;
+    }
+    return applyRedirections(&spec);
+}
+
+void unredirection()
+{
+    if (unRedirection)
+    {
+        dup2(original_stdin, STDIN_FILENO);
+        dup2(original_stdout, STDOUT_FILENO);
+        dup2(original_stderr, STDERR_FILENO);
+        unRedirection = 0;
+    }
+}
+
+// bookmark [-n name] "command" | -l | -i index|name | -i SPEC... [-j N] | -d index|name
+int bookmarkCommand(char **args)
+{
+    int index;
+
+    if (args[1] == NULL)
+    {
+        return 0;
+    }
+    loadBookmarks();
+    if (strcmp(args[1], "-l") == 0)
+    {
+        // List bookmarks
+        listBookmarks();
+    }
+    else if (strcmp(args[1], "-i") == 0)
+    {
+        // Execute bookmark by index or name
+        if (args[2] == NULL)
+        {
+            fprintf(stderr, "Usage: bookmark -i index|name\n");
+            return 1;
+        }
+        // Lists, ranges and -j run concurrently with a summary
+        if (args[3] != NULL || strchr(args[2], ',') != NULL ||
+            (isdigit((unsigned char)args[2][0]) && strchr(args[2], '-') != NULL))
+        {
+            return runBookmarks(&args[2]);
+        }
+        if ((index = findBookmark(args[2])) == -1)
+        {
+            return 1;
+        }
+        return executeBookmark(index);
+    }
+    else if (strcmp(args[1], "-d") == 0)
+    {
+        // Delete bookmark by index or name
+        if (args[2] == NULL)
+        {
+            fprintf(stderr, "Usage: bookmark -d index|name\n");
+            return 1;
+        }
+        if ((index = findBookmark(args[2])) == -1)
+        {
+            return 1;
+        }
+        return deleteBookmark(index);
+    }
+    else
+    {
+        // Add new bookmark
+        int bookmarkIndex = 1;
+        const char *name = NULL;
+        if (strcmp(args[1], "-n") == 0)
+        {
+            name = args[2];
+            bookmarkIndex = 3;
+            if (name == NULL || args[3] == NULL || isdigit((unsigned char)name[0]))
+            {
+                fprintf(stderr, "Usage: bookmark -n name \"command\" (names do not start with a digit)\n");
+                return 1;
+            }
+        }
+        size_t bookmarkLength = 0;
+        for (int i = bookmarkIndex; args[i] != NULL; i++)
+        {
+            bookmarkLength += strlen(args[i]) + 1;
+        }
+        char *bookmarkCommand = malloc(bookmarkLength);
+        if (bookmarkCommand == NULL)
+        {
+            perror("malloc");
+            return 1;
+        }
+        strcpy(bookmarkCommand, args[bookmarkIndex]);
+        for (int i = bookmarkIndex + 1; args[i] != NULL; i++)
+        {
+            strcat(bookmarkCommand, " ");
+            strcat(bookmarkCommand, args[i]);
+        }
+        int status = addBookmark(name, bookmarkCommand);
+        free(bookmarkCommand);
+        return status;
+    }
+    return 0;
+}
+
+// Bookmarks are kept in the on-disk record format, so a store loaded from
+// the file is used where it lies in the mapping. The name table is open
+// addressing over bookmark indices, rebuilt when indices shift.
+int bookmarkFilePath(char *path, size_t size)
+{
+    const char *env = getenv("MYSHELL_BOOKMARKS");
+
+    if (env != NULL && env[0] != '\0')
+    {
+        snprintf(path, size, "%s", env);
+    }
+    else if ((env = getenv("HOME")) != NULL && env[0] != '\0')
+    {
+        snprintf(path, size, "%s/.myshell_bookmarks", env);
+    }
+    else
+    {
+        return -1;
+    }
+    return 0;
+}
+
+void indexBookmarkName(int index)
+{
+    size_t slot = hashCacheKey(bookmarks[index].name, strlen(bookmarks[index].name)) & bookmarkNameMask;
+
+    while (bookmarkNames[slot] != 0)
+    {
+        slot = (slot + 1) & bookmarkNameMask;
+    }
+    bookmarkNames[slot] = index + 1;
+}
+
+// Sized for at most half full
+void rebuildBookmarkNames()
+{
+    size_t slots = 16;
+
+    while (slots < (size_t)bookmarkCount * 2)
+    {
+        slots *= 2;
+    }
+    free(bookmarkNames);
+    bookmarkNames = calloc(slots, sizeof(int));
+    if (bookmarkNames == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    bookmarkNameMask = slots - 1;
+    for (int i = 0; i < bookmarkCount; i++)
+    {
+        if (bookmarks[i].name != NULL)
+        {
+            indexBookmarkName(i);
+        }
+    }
+}
+
+int findBookmarkName(const char *name)
+{
+    if (bookmarkNames == NULL)
+    {
+        return -1;
+    }
+    size_t slot = hashCacheKey(name, strlen(name)) & bookmarkNameMask;
+
+    while (bookmarkNames[slot] != 0)
+    {
+        struct bookmark *bookmark = &bookmarks[bookmarkNames[slot] - 1];
+        if (bookmark->name != NULL && strcmp(bookmark->name, name) == 0)
+        {
+            return bookmarkNames[slot] - 1;
+        }
+        slot = (slot + 1) & bookmarkNameMask;
+    }
+    return -1;
+}
+
+// Adds a record to the in-memory store; owned records were malloc'd here,
+// the others live in the mapped file
+// Checks that the name, command, path and argCount words all end inside
+// the record; returns the length of the words or -1
+ssize_t checkBookmarkRecord(const struct bookmarkRecord *record)
+{
+    const char *strings = (const char *)(record + 1);
+    const char *end = (const char *)record + record->size;
+    size_t lengths[3] = {record->nameLength, record->commandLength, record->pathLength};
+
+    if (record->argCount == 0)
+    {
+        return -1;
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        if (lengths[i] >= (size_t)(end - strings) || strings[lengths[i]] != '\0' ||
+            memchr(strings, '\0', lengths[i]) != NULL)
+        {
+            return -1;
+        }
+        strings += lengths[i] + 1;
+    }
+    const char *word = strings;
+    for (uint32_t i = 0; i < record->argCount; i++)
+    {
+        const char *nul = word < end ? memchr(word + 1, '\0', end - word - 1) : NULL;
+        if (nul == NULL || (word[0] == 1 && operatorFor(word + 1) == NULL))
+        {
+            return -1;
+        }
+        word = nul + 1;
+    }
+    return word - strings;
+}
+
+int attachBookmark(const struct bookmarkRecord *record, int owned)
+{
+    ssize_t wordsLength = checkBookmarkRecord(record);
+
+    if (wordsLength == -1)
+    {
+        return -1;
+    }
+    if (bookmarkCount == bookmarkCapacity)
+    {
+        bookmarkCapacity = bookmarkCapacity ? bookmarkCapacity * 2 : 16;
+        bookmarks = realloc(bookmarks, bookmarkCapacity * sizeof(struct bookmark));
+        if (bookmarks == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    struct bookmark *bookmark = &bookmarks[bookmarkCount++];
+    const char *strings = (const char *)(record + 1);
+
+    bookmark->record = record;
+    bookmark->name = record->nameLength > 0 ? strings : NULL;
+    bookmark->command = strings + record->nameLength + 1;
+    bookmark->path = bookmark->command + record->commandLength + 1;
+    bookmark->words = bookmark->path + record->pathLength + 1;
+    bookmark->wordsLength = wordsLength;
+    bookmark->args = NULL;
+    bookmark->owned = owned;
+
+    if (bookmark->name != NULL)
+    {
+        if (bookmarkNames == NULL || (size_t)bookmarkCount * 2 > bookmarkNameMask + 1)
+        {
+            rebuildBookmarkNames();
+        }
+        else
+        {
+            indexBookmarkName(bookmarkCount - 1);
+        }
+    }
+    return 0;
 }
 
-void executeCommand(char **args, int background)
+// A file from before operator flags: each command is lexed again from its
+// text into a current record
+void upgradeBookmarks(const char *map, size_t size)
 {
-    pid_t pid, wpid;
-    int status;
+    size_t offset = sizeof(struct bookmarkFileHeader);
 
-    pid = fork();
-    // printf("execude sa\n");
-    // printf("args[0]: %s\n", args[0]);
-    if (pid == 0)
+    while (offset + sizeof(struct bookmarkRecord) <= size)
     {
-        // printf("child burada\n");
-        //  Child process
-        char fullPath[256];
-        // printf("deneme\n");
-        int result = findExecutable(args[0], fullPath);
-        // printf("result: %d\n", result);
-        if (result)
-        {
-            // printf("hata 0 \n");
-            // printf("fullPath: %s\n", fullPath);
-            /*for (int i = 0; args[i] != NULL; i++)
-            {
-                printf("args[%d]: %s\n", i, args[i]);
-            }*/
-            int execvResult = execv(fullPath, args);
-            // printf("execvResult: %d\n", execvResult);
-            if (execvResult == -1)
-            {
-                perror("myshell");
-                exit(EXIT_FAILURE);
-            }
-
-            /*if (execv(fullPath, args) == -1)
-            {
-                printf("hata 1 \n");
-                perror("myshell");
+        const struct bookmarkRecord *record = (const struct bookmarkRecord *)(map + offset);
+        const char *name = (const char *)(record + 1);
+        const char *command = name + record->nameLength + 1;
 
-                exit(EXIT_FAILURE);
-            }*/
-            // printf("hata 3 \n");
+        if (record->size < sizeof(struct bookmarkRecord) + record->nameLength + record->commandLength + 2 ||
+            record->size > size - offset || record->size % 8 != 0)
+        {
+            break;
         }
-        else
+        if (name[record->nameLength] == '\0' && command[record->commandLength] == '\0')
         {
-            //  printf("hata 2 \n");
-            perror("myshell");
-            exit(EXIT_FAILURE);
+            struct bookmarkRecord *current = buildBookmarkRecord(record->nameLength > 0 ? name : NULL, command);
+            if (current != NULL && attachBookmark(current, 1) == -1)
+            {
+                free(current);
+            }
         }
-        // printf("Result: %d\n", result);
-        // printf("child burada 2\n");
+        offset += record->size;
     }
-    else if (pid < 0)
+}
+
+// Maps the bookmark file once, on first use; every record is checked to lie
+// within the file with its strings terminated inside it, a torn last record
+// is ignored and a malformed one is skipped
+void loadBookmarks()
+{
+    char path[MAX_PATH_SIZE];
+    struct stat st;
+
+    if (bookmarksLoaded)
     {
-        perror("myshell");
+        return;
     }
-    else
+    bookmarksLoaded = 1;
+    if (bookmarkFilePath(path, sizeof(path)) == -1)
+    {
+        return;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
     {
+        return;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct bookmarkFileHeader))
+    {
+        close(fd);
+        return;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        perror("mmap");
+        return;
+    }
+    if (memcmp(((const struct bookmarkFileHeader *)map)->magic, BOOKMARK_MAGIC_V1, 8) == 0)
+    {
+        upgradeBookmarks(map, st.st_size);
+        munmap(map, st.st_size);
+        saveBookmarks();
+        return;
+    }
+    if (memcmp(((const struct bookmarkFileHeader *)map)->magic, BOOKMARK_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "myshell: %s: not a bookmark file\n", path);
+        munmap(map, st.st_size);
+        return;
+    }
+    bookmarkMap = map;
+    bookmarkMapSize = st.st_size;
+
+    size_t offset = sizeof(struct bookmarkFileHeader);
+    while (offset + sizeof(struct bookmarkRecord) <= bookmarkMapSize)
+    {
+        const struct bookmarkRecord *record = (const struct bookmarkRecord *)((const char *)map + offset);
+        size_t strings = (size_t)record->nameLength + record->commandLength + record->pathLength + 3;
 
-        if (!background)
+        if (record->size < sizeof(struct bookmarkRecord) + strings || record->size > bookmarkMapSize - offset ||
+            record->size % 8 != 0)
         {
-            do
-            {
-                wpid = waitpid(pid, &status, WUNTRACED);
-            } while (!WIFEXITED(status) && !WIFSIGNALED(status));
+            break;
         }
-        else
+        if (attachBookmark(record, 0) == -1)
         {
-            printf("Background process ID: %d\n", pid);
-            return;
+            fprintf(stderr, "myshell: %s: skipping a malformed bookmark\n", path);
         }
+        offset += record->size;
     }
 }
 
-int findExecutable(const char *command, char *fullPath)
+// Lexes command once and records its words, and the executable's path
+// unless it is a builtin or a pipeline, after the name and command
+struct bookmarkRecord *buildBookmarkRecord(const char *name, const char *command)
 {
-    char *pathEnv = getenv("PATH");
-    if (pathEnv == NULL)
+    int background = 0;
+    int wordCount = lexCommand(&bookmarkArena, command, strlen(command), &background);
+    char fullPath[MAX_PATH_SIZE] = "";
+
+    if (wordCount <= 0)
     {
-        perror("getenv");
-        return 0;
+        fprintf(stderr, "myshell: bookmark: %s\n", wordCount == 0 ? "empty command" : "unfinished quote in command");
+        return NULL;
     }
-
-    char *path = strdup(pathEnv);
-
-    char *token = strtok(path, ":");
-
-    while (token != NULL)
+    if (!isPipeline(bookmarkArena.args) && findBuiltin(bookmarkArena.args[0]) == NULL &&
+        !findExecutable(bookmarkArena.args[0], fullPath))
     {
+        fullPath[0] = '\0'; // resolved again when run, PATH may change
+    }
 
-        snprintf(fullPath, 255, "%s/%s", token, command);
-
-        if (access(fullPath, X_OK) == 0)
-        {
-            free(path);
-            return 1;
-        }
+    size_t nameLength = name != NULL ? strlen(name) : 0;
+    size_t commandLength = strlen(command);
+    size_t pathLength = strlen(fullPath);
+    size_t size = sizeof(struct bookmarkRecord) + nameLength + commandLength + pathLength + 3;
+    for (int i = 0; i < wordCount; i++)
+    {
+        size += strlen(bookmarkArena.args[i]) + 2;
+    }
+    size = (size + 7) & ~(size_t)7;
 
-        token = strtok(NULL, ":");
+    struct bookmarkRecord *record = calloc(1, size);
+    if (record == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
     }
+    record->size = size;
+    record->argCount = wordCount;
+    record->nameLength = nameLength;
+    record->commandLength = commandLength;
+    record->pathLength = pathLength;
+    record->background = background;
 
-    free(path);
-    return 0;
+    char *out = (char *)(record + 1);
+    memcpy(out, name != NULL ? name : "", nameLength + 1);
+    out += nameLength + 1;
+    memcpy(out, command, commandLength + 1);
+    out += commandLength + 1;
+    memcpy(out, fullPath, pathLength + 1);
+    out += pathLength + 1;
+    for (int i = 0; i < wordCount; i++)
+    {
+        size_t length = strlen(bookmarkArena.args[i]) + 1;
+        *out++ = isOperator(bookmarkArena.args[i]);
+        memcpy(out, bookmarkArena.args[i], length);
+        out += length;
+    }
+    return record;
 }
 
-void searchFilesKaragulHelper(const char *filePath, const char *searchString)
+// Adding appends one record; the header goes first into a new file
+void appendBookmarkRecord(const struct bookmarkRecord *record)
 {
-    FILE *file = fopen(filePath, "r");
-    if (file == NULL)
+    char path[MAX_PATH_SIZE];
+    struct stat st;
+
+    if (bookmarkFilePath(path, sizeof(path)) == -1)
     {
-        perror("fopen");
         return;
     }
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        perror("myshell: bookmark");
+        return;
+    }
+    struct bookmarkFileHeader header;
+    struct iovec iov[2];
+    int count = 0;
+    if (fstat(fd, &st) == 0 && st.st_size == 0)
+    {
+        memcpy(header.magic, BOOKMARK_MAGIC, 8);
+        iov[count++] = (struct iovec){&header, sizeof(header)};
+    }
+    iov[count++] = (struct iovec){(void *)record, record->size};
+    if (writeAll(fd, iov, count) == -1)
+    {
+        perror("myshell: bookmark");
+    }
+    close(fd);
+}
 
-    char line[MAX_LINE_SIZE];
-    int lineNumber = 0;
+// Deleting rewrites the file through a temporary and rename(), so the
+// mapping, which still holds the old file, stays valid
+void saveBookmarks()
+{
+    char path[MAX_PATH_SIZE];
+    char temp[MAX_PATH_SIZE + 8];
+    struct bookmarkFileHeader header;
 
-    while (fgets(line, sizeof(line), file) != NULL)
+    if (bookmarkFilePath(path, sizeof(path)) == -1)
     {
-        lineNumber++;
-        if (strstr(line, searchString) != NULL)
-        {
-            printf("%-5d: %s -> %s", lineNumber, filePath, line);
-        }
+        return;
+    }
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        perror("myshell: bookmark");
+        return;
+    }
+    struct iovec *iov = malloc((bookmarkCount + 1) * sizeof(struct iovec));
+    if (iov == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(header.magic, BOOKMARK_MAGIC, 8);
+    iov[0] = (struct iovec){&header, sizeof(header)};
+    for (int i = 0; i < bookmarkCount; i++)
+    {
+        iov[i + 1] = (struct iovec){(void *)bookmarks[i].record, bookmarks[i].record->size};
+    }
+    int failed = writeAll(fd, iov, bookmarkCount + 1) == -1;
+    free(iov);
+    if (close(fd) == -1 || failed || rename(temp, path) == -1)
+    {
+        perror("myshell: bookmark");
+        unlink(temp);
     }
+}
 
-    fclose(file);
+int addBookmark(const char *name, const char *command)
+{
+    if (name != NULL && findBookmarkName(name) != -1)
+    {
+        fprintf(stderr, "myshell: bookmark: %s: already exists\n", name);
+        return 1;
+    }
+    struct bookmarkRecord *record = buildBookmarkRecord(name, command);
+    if (record == NULL)
+    {
+        return 1;
+    }
+    attachBookmark(record, 1);
+    appendBookmarkRecord(record);
+    return 0;
 }
 
-void concatenatePaths(const char *path1, const char *path2, char *result)
+void listBookmarks()
 {
-    strcpy(result, path1);
-    strcat(result, "/");
-    strcat(result, path2);
+    for (int i = 0; i < bookmarkCount; ++i)
+    {
+        if (bookmarks[i].name != NULL)
+        {
+            printf("%d %s \"%s\"\n", i, bookmarks[i].name, bookmarks[i].command);
+        }
+        else
+        {
+            printf("%d \"%s\"\n", i, bookmarks[i].command);
+        }
+    }
 }
 
-void searchFilesKaragul(char *searchString, int recursive)
+// An index, or a name through the name table
+int findBookmark(const char *spec)
 {
-    DIR *dir;
-    struct dirent *entry;
-    char currentDir[MAX_FILE_NAME_SIZE];
-    char startDir[MAX_FILE_NAME_SIZE];
+    char *end;
+    long index = strtol(spec, &end, 10);
 
-    if (getcwd(startDir, sizeof(startDir)) == NULL)
+    if (*end != '\0' || end == spec)
     {
-        perror("getcwd");
-        return;
+        index = findBookmarkName(spec);
     }
-
-    if ((dir = opendir(startDir)) == NULL)
+    if (index < 0 || index >= bookmarkCount)
     {
-        perror("opendir");
-        return;
+        fprintf(stderr, "myshell: bookmark: %s: no such bookmark\n", spec);
+        return -1;
     }
+    return index;
+}
 
-    while ((entry = readdir(dir)) != NULL)
+// Adds the bookmarks named by spec to list: "3", "name", "0-5", or several
+// of those joined by commas
+int collectBookmarks(char *spec, int **list, int *count, int *capacity)
+{
+    for (char *part = strtok(spec, ","); part != NULL; part = strtok(NULL, ","))
     {
-        if (entry->d_type == DT_REG)
-        {
-            char filePath[MAX_FILE_NAME_SIZE];
-            concatenatePaths(startDir, entry->d_name, filePath);
+        int first;
+        int last;
+        char *dash = strchr(part, '-');
 
-            size_t len = strlen(filePath);
-            if ((len > 2) &&
-                ((filePath[len - 2] == '.') &&
-                 ((filePath[len - 1] == 'c') || (filePath[len - 1] == 'C') ||
-                  (filePath[len - 1] == 'h') || (filePath[len - 1] == 'H'))))
+        if (isdigit((unsigned char)part[0]) && dash != NULL)
+        {
+            char *end;
+            first = strtol(part, &end, 10);
+            last = strtol(dash + 1, &end, 10);
+            if (end == dash + 1 || *end != '\0' || first > last || last >= bookmarkCount)
             {
-                searchFilesKaragulHelper(filePath, searchString);
+                fprintf(stderr, "myshell: bookmark: %s: bad range\n", part);
+                return -1;
             }
         }
-        else if (recursive && entry->d_type == DT_DIR && strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+        else if ((first = last = findBookmark(part)) == -1)
         {
-            char subDir[MAX_FILE_NAME_SIZE];
-            concatenatePaths(startDir, entry->d_name, subDir);
+            return -1;
+        }
 
-            if (chdir(subDir) == -1)
+        for (int index = first; index <= last; index++)
+        {
+            if (*count == *capacity)
             {
-                perror("chdir");
-                closedir(dir);
-                return;
+                *capacity = *capacity ? *capacity * 2 : 16;
+                *list = realloc(*list, *capacity * sizeof(int));
+                if (*list == NULL)
+                {
+                    perror("realloc");
+                    exit(EXIT_FAILURE);
+                }
             }
+            (*list)[(*count)++] = index;
+        }
+    }
+    return 0;
+}
 
-            searchFilesKaragul(searchString, recursive);
+// bookmark -i SPEC... [-j N]: every bookmark runs in a forked subshell, at
+// most N at once, and a table of exit statuses and wall times follows.
+// Being subshells, bookmarks that cd or export do not change this shell.
+int runBookmarks(char **specs)
+{
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int *list = NULL;
+    int count = 0;
+    int capacity = 0;
 
-            if (chdir(startDir) == -1)
+    for (int i = 0; specs[i] != NULL; i++)
+    {
+        if (strcmp(specs[i], "-j") == 0)
+        {
+            if (specs[i + 1] == NULL || (jobs = atol(specs[++i])) < 1)
             {
-                perror("chdir");
-                closedir(dir);
-                return;
+                fprintf(stderr, "Usage: bookmark -i index|name|first-last[,...]... [-j N]\n");
+                free(list);
+                return 1;
             }
         }
+        else if (collectBookmarks(specs[i], &list, &count, &capacity) == -1)
+        {
+            free(list);
+            return 1;
+        }
     }
 
-    if (closedir(dir) == -1)
+    pid_t *slots = calloc(jobs, sizeof(pid_t));
+    int *slotEntries = malloc(jobs * sizeof(int));
+    int *statuses = malloc((count + 1) * sizeof(int));
+    struct timespec *started = malloc((count + 1) * sizeof(struct timespec));
+    struct timespec *finished = malloc((count + 1) * sizeof(struct timespec));
+    if (slots == NULL || slotEntries == NULL || statuses == NULL || started == NULL || finished == NULL)
     {
-        perror("closedir");
+        perror("malloc");
+        exit(EXIT_FAILURE);
     }
-}
 
-void redirection(char **args)
-{
-    for (int i = 0; args[i] != NULL; i++)
+    int next = 0;
+    int running = 0;
+    int interrupted = 0;
+    fflush(stdout);
+
+    while (running > 0 || (next < count && !interrupted))
     {
-        if (strcmp(args[i], ">") == 0 || strcmp(args[i], ">>") == 0 || strcmp(args[i], "2>") == 0 || strcmp(args[i], "<") == 0)
+        for (long slot = 0; slot < jobs && next < count && !interrupted; slot++)
         {
-            if (args[i + 1] != NULL)
+            if (slots[slot] != 0)
             {
-                char *fileName = args[i + 1];
-
-                if (redirection_fd != -1)
-                {
-                    close(redirection_fd);
-                }
-
-                if (strcmp(args[i], ">") == 0)
-                {
-                    redirection_fd = open(fileName, O_CREAT | O_TRUNC | O_WRONLY, 0666);
-                    dup2(redirection_fd, STDOUT_FILENO);
-                }
-                else if (strcmp(args[i], ">>") == 0)
-                {
-                    redirection_fd = open(fileName, O_CREAT | O_APPEND | O_WRONLY, 0666);
-                    dup2(redirection_fd, STDOUT_FILENO);
-                }
-                else if (strcmp(args[i], "2>") == 0)
-                {
-                    redirection_fd = open(fileName, O_CREAT | O_TRUNC | O_WRONLY, 0666);
-                    dup2(redirection_fd, STDERR_FILENO);
-                }
-                else if (strcmp(args[i], "<") == 0)
-                {
-                    redirection_fd = open(fileName, O_RDONLY);
-                    dup2(redirection_fd, STDIN_FILENO);
-                }
+                continue;
+            }
+            int entry = next++;
+            clock_gettime(CLOCK_MONOTONIC, &started[entry]);
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                // A non-interactive subshell in this shell's process group
+                enterJobGroup(shellPgid, 0);
+                jobControl = 0;
+                interactive = 0;
+                background = 0;
+                exit(executeBookmark(list[entry]));
+            }
+            if (pid < 0)
+            {
+                perror("fork");
+                statuses[entry] = 126;
+                finished[entry] = started[entry];
+                continue;
+            }
+            slots[slot] = pid;
+            slotEntries[slot] = entry;
+            running++;
+        }
+        if (running == 0)
+        {
+            continue;
+        }
 
-                if (redirection_fd == -1)
+        int status;
+        pid_t pid = waitSchedulerChild(&status);
+        if (pid == -1)
+        {
+            break;
+        }
+        for (long slot = 0; slot < jobs; slot++)
+        {
+            if (slots[slot] == pid)
+            {
+                int entry = slotEntries[slot];
+                slots[slot] = 0;
+                running--;
+                clock_gettime(CLOCK_MONOTONIC, &finished[entry]);
+                statuses[entry] = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                if (WIFSIGNALED(status) && WTERMSIG(status) == SIGINT)
                 {
-                    perror("open");
-                    exit(EXIT_FAILURE);
+                    interrupted = 1;
                 }
-
-                args[i] = NULL;
-                args[i + 1] = NULL;
-                unRedirection = 1;
-            }
-            else
-            {
-                fprintf(stderr, "Error: Missing filename after %s\n", args[i]);
-                exit(EXIT_FAILURE);
+                break;
             }
         }
     }
-}
 
-void unredirection()
-{
-    if (unRedirection)
+    int failed = 0;
+    printf("%-6s %-16s %-8s %9s  %s\n", "INDEX", "NAME", "STATUS", "TIME", "COMMAND");
+    for (int entry = 0; entry < count; entry++)
     {
-        close(redirection_fd);
-        dup2(original_stdin, STDIN_FILENO);
-        dup2(original_stdout, STDOUT_FILENO);
-        dup2(original_stderr, STDERR_FILENO);
-        unRedirection = 0;
-    }
-}
+        struct bookmark *bookmark = &bookmarks[list[entry]];
+        char status[16];
 
-void addBookmark(const char *command)
-{
-    if (bookmarkCount < MAX_BOOKMARKS)
-    {
-        bookmarks[bookmarkCount++] = strdup(command);
+        if (entry >= next)
+        {
+            snprintf(status, sizeof(status), "skipped");
+            failed = 1;
+        }
+        else
+        {
+            snprintf(status, sizeof(status), "%d", statuses[entry]);
+            failed |= statuses[entry] != 0;
+        }
+        double seconds = entry >= next ? 0 : (finished[entry].tv_sec - started[entry].tv_sec) +
+                                                 (finished[entry].tv_nsec - started[entry].tv_nsec) / 1e9;
+        printf("%-6d %-16s %-8s %8.2fs  %s\n", list[entry], bookmark->name != NULL ? bookmark->name : "-", status,
+               seconds, bookmark->command);
     }
-    else
+
+    free(list);
+    free(slots);
+    free(slotEntries);
+    free(statuses);
+    free(started);
+    free(finished);
+    if (interrupted)
     {
-        fprintf(stderr, "Bookmark list is full. Cannot add more bookmarks.\n");
+        return 130;
     }
+    return failed;
 }
-void listBookmarks()
+
+// Runs a bookmark the way the main loop runs a line, from a copy of its
+// stored words, since redirections and pipes are cut out of the array and
+// builtins may edit the words; the stored path is used while it is still
+// executable
+int executeBookmark(int index)
 {
-    int i;
-    for (i = 0; i < bookmarkCount; ++i)
+    static int depth;
+    struct bookmark *bookmark = &bookmarks[index];
+    const struct bookmarkRecord *record = bookmark->record;
+
+    if (depth == BOOKMARK_DEPTH)
     {
-        printf("%d \"%s\"\n", i, bookmarks[i]);
+        fprintf(stderr, "myshell: bookmark: %s: too many nested bookmarks\n", bookmark->command);
+        return 1;
     }
-}
-void executeBookmark(int index)
-{
-    if (index >= 0 && index < bookmarkCount)
+    if (bookmark->args == NULL)
     {
-        strcpy(inputBuffer, bookmarks[index]);
-
-        char *token;
-
-        int i = 0;
-        token = strtok(inputBuffer, " ");
-        while (token != NULL && i < MAX_ARG_SIZE - 1)
+        bookmark->args = malloc((record->argCount + 1) * sizeof(char *));
+        if (bookmark->args == NULL)
         {
-            args[i++] = token;
-            token = strtok(NULL, " ");
+            perror("malloc");
+            exit(EXIT_FAILURE);
         }
-
-        for (; i < MAX_ARG_SIZE; i++)
+        const char *word = bookmark->words;
+        for (uint32_t i = 0; i < record->argCount; i++)
         {
-            args[i] = NULL;
+            bookmark->args[i] = word[0] == 1 ? operatorFor(word + 1) : (char *)word + 1;
+            word += strlen(word + 1) + 2;
         }
+        bookmark->args[record->argCount] = NULL;
+    }
 
-        executeCommand(args, background);
+    // Builtins write into their words, so they get a private copy; the
+    // record may be a read-only mapping and is reused by later runs
+    char **runArgs = malloc((record->argCount + 1) * sizeof(char *) + bookmark->wordsLength);
+    if (runArgs == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
     }
-    else
+    char *runWords = (char *)(runArgs + record->argCount + 1);
+    memcpy(runWords, bookmark->words, bookmark->wordsLength);
+    for (uint32_t i = 0; i < record->argCount; i++)
     {
-        fprintf(stderr, "Invalid bookmark index.\n");
+        int operator = isOperator(bookmark->args[i]);
+        runArgs[i] = operator ? bookmark->args[i] : runWords + (bookmark->args[i] - bookmark->words);
     }
-}
-void deleteBookmark(int index)
-{
-    if (index >= 0 && index < bookmarkCount)
+    runArgs[record->argCount] = NULL;
+
+    const char *savedText = commandText;
+    size_t savedLength = commandLength;
+    int runInBackground = background || record->background;
+    const struct builtin *builtin;
+    commandText = bookmark->command;
+    commandLength = record->commandLength;
+    depth++;
+
+    if (isPipeline(runArgs))
+    {
+        runPipeline(runArgs, runInBackground);
+    }
+    else if ((builtin = findBuiltin(runArgs[0])) != NULL)
+    {
+        lastStatus = runBuiltin(builtin, runArgs);
+    }
+    else
     {
-        free(bookmarks[index]);
+        struct redirectSpec spec;
+        char fullPath[MAX_PATH_SIZE];
+        pid_t pid;
 
-        for (int i = index; i < bookmarkCount - 1; ++i)
+        int ready = parseRedirections(runArgs, &spec) == 0 && runArgs[0] != NULL;
+
+        if (!ready)
         {
-            bookmarks[i] = bookmarks[i + 1];
+            lastStatus = 1;
+        }
+        else if (record->pathLength > 0 && access(bookmark->path, X_OK) == 0)
+        {
+            snprintf(fullPath, sizeof(fullPath), "%s", bookmark->path);
+        }
+        else if (!findExecutable(runArgs[0], fullPath))
+        {
+            fprintf(stderr, "myshell: %s: %s\n", runArgs[0], strerror(errno));
+            lastStatus = 127;
+            ready = 0;
+        }
+        if (ready)
+        {
+            if (launchStage(runArgs, &spec, fullPath, -1, -1, 0, !runInBackground, &pid) == 0)
+            {
+                waitForChild(pid, runInBackground);
+            }
+            else
+            {
+                lastStatus = 126;
+            }
         }
-
-        --bookmarkCount;
     }
-    else
+
+    depth--;
+    commandText = savedText;
+    commandLength = savedLength;
+    free(runArgs);
+    return lastStatus;
+}
+
+int deleteBookmark(int index)
+{
+    if (bookmarks[index].owned)
     {
-        fprintf(stderr, "Invalid bookmark index.\n");
+        free((void *)bookmarks[index].record);
     }
+    free(bookmarks[index].args);
+    memmove(&bookmarks[index], &bookmarks[index + 1], (bookmarkCount - index - 1) * sizeof(struct bookmark));
+    --bookmarkCount;
+    rebuildBookmarkNames();
+    saveBookmarks();
+    return 0;
 }
-void exitShell()
+// exit [N]: without N the shell exits with the last command's status
+int exitShell(char **args)
 {
     int status;
     pid_t wpid;
@@ -604,6 +9635,21 @@ void exitShell()
         printf("Background process %d terminated.\n", wpid);
     }
 
-    printf("Exiting the shell.\n");
-    exit(EXIT_SUCCESS);
+    // Stopped jobs would never be continued once the shell is gone
+    for (int id = 1; id <= jobHighest; id++)
+    {
+        struct job *job = jobTable[id - 1];
+        if (job != NULL && job->stopped > 0)
+        {
+            signalJob(job, SIGHUP);
+            signalJob(job, SIGCONT);
+        }
+    }
+
+    flushHistory();
+    if (interactive)
+    {
+        printf("Exiting the shell.\n");
+    }
+    exit(args[1] != NULL ? atoi(args[1]) & 0xff : lastStatus);
 }
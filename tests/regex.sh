@@ -0,0 +1,71 @@
+#!/bin/sh
+# Regression tests for search -E.
+# Usage: sh tests/regex.sh [path/to/myShell]   (default ./myShell)
+#
+# Each case is a pattern and the line numbers of tests/regex.txt it must
+# match, or "error" when the pattern must be rejected without killing the shell.
+
+shell=$(cd "$(dirname "${1:-./myShell}")" && pwd)/$(basename "${1:-./myShell}")
+fixture=$(cd "$(dirname "$0")" && pwd)/regex.txt
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+cp "$fixture" "$work/regex.c"
+export MYSHELL_CACHE_DIR="$work/.cache"
+failures=0
+
+check()
+{
+    pattern=$1
+    expected=$2
+    if [ "$expected" = error ]; then
+        actual=$(cd "$work" && "$shell" -c "search -E '$pattern'
+echo alive" 2>/dev/null)
+        [ "$actual" = alive ] && result=error || result="$actual"
+    else
+        result=$(cd "$work" && "$shell" -c "search --no-cache -E '$pattern'" | awk '{printf "%s%s", sep, $1; sep=" "}')
+    fi
+    if [ "$result" != "$expected" ]; then
+        echo "FAIL: '$pattern': expected [$expected], got [$result]"
+        failures=$((failures + 1))
+    fi
+}
+
+# Alternation
+check 'cat|dog' '1 2'
+check '^(cat|dog)$' '1 2'
+check 'x(ab|cd)y' '7 8'
+check 'a|b|c|zebra' '1 3 4 5 6 7 8 14'
+
+# Empty groups and empty alternatives
+check 'c()at' '1'
+check 'ca(|t)' '1 14'
+check '^()$' '13'
+check 'x(ab|)y' '7 9'
+
+# Bounded repeats
+check '^a{3}$' '3'
+check '^a{2,3}$' '3 4'
+check '^a{4,}$' '5'
+check '^(ab){2}$' '6'
+check '^x(ab){0,1}y$' '7 9'
+check 'a{1001}' 'error'
+check '((a{1000}){1000}){1000}' 'error'
+check 'a{3,2}' 'error'
+
+# Bracket expressions and classes
+check '^[[:digit:]]+$' '10'
+check '[[:upper:]]' '11'
+check '^[[:alpha:][:space:]]+$' '1 2 3 4 5 6 7 8 9 11 14'
+check '^[^[:alnum:]]+$' '12'
+check '[[:xdigit:]]{3}' '3 5 6 10 14'
+check '[[:bogus:]]' 'error'
+check '[[=a=]]' 'error'
+check '[]x]y' '9'
+check '[0-9][a-f]' ''
+check '\d\d' '10'
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures regex test(s) failed"
+    exit 1
+fi
+echo "regex tests passed"